@@ -0,0 +1,233 @@
+/****************************************************************************
+ *
+ * bank.c - preset banks
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bank.h"
+#include "debug.h"
+
+/* Layout of bank file */
+struct bank_file
+{
+  char magic[8];
+  uint32_t size;   /* sizeof(struct bank) */
+  uint32_t nbanks;
+  struct bank bank[BANKS];
+};
+
+static struct bank_file *banks;  /* mapped bank file, NULL if none */
+static uint32_t banks_valid;     /* bit set = bank stored and usable */
+
+/* Reverse dispatch table of each valid bank, built when the bank file is
+ * opened or the bank is stored, so that recalling a bank only needs to
+ * switch tables. */
+static struct router_feedback bank_feedback[BANKS];
+
+/* Check that dispatch table from file is safe to use */
+static int
+map_ok(const struct control_map *map)
+{
+  int cc;
+
+  for (cc = 0; cc < CONTROLS; cc++) {
+    if (map[cc].type >= CTL_TYPES)
+      return 0;
+    if (map[cc].type == CTL_NONE)
+      continue;
+    if (map[cc].channel < 1 || map[cc].channel > 16 || map[cc].cc > 127 ||
+        map[cc].accel >= ACCEL_CURVES ||
+        map[cc].nrpn > 16383 || map[cc].outputs >> router_noutputs ||
+        ((map[cc].flags & MAP_NRPN) && map[cc].type != CTL_ENCODER) ||
+        ((map[cc].flags & (MAP_14BIT | MAP_NRPN)) == MAP_14BIT &&
+         map[cc].cc > 31))
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Check that bank from file is safe to use: toggle states are sent as
+ * MIDI, and LED values as Nocturn CC values, so must all be 7 bit. */
+static int
+bank_ok(const struct bank *bank)
+{
+  int i;
+
+  if (!map_ok(bank->map))
+    return 0;
+  for (i = 0; i < CONTROLS; i++)
+    if (bank->toggle[i] > 127)
+      return 0;
+  for (i = 0; i < LEDS; i++)
+    if (bank->leds[i] > 127)
+      return 0;
+
+  return 1;
+}
+
+/* Open bank file */
+int
+banks_open(const char *filename)
+{
+  struct stat st;
+  void *mem;
+  int fd;
+  int n;
+
+  fd = open(filename, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    errprintf("Can't open bank file %s\n", filename);
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 ||
+      (!st.st_size && ftruncate(fd, sizeof(struct bank_file)) < 0)) {
+    errprintf("Can't set up bank file %s\n", filename);
+    close(fd);
+    return -1;
+  }
+  if (st.st_size && st.st_size != sizeof(struct bank_file)) {
+    errprintf("%s is not a bank file\n", filename);
+    close(fd);
+    return -1;
+  }
+
+  mem = mmap(NULL, sizeof(struct bank_file), PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    errprintf("Can't map bank file %s\n", filename);
+    return -1;
+  }
+  banks = mem;
+
+  /* A new file is all zeroes, i.e. no banks stored */
+  if (!st.st_size) {
+    memcpy(banks->magic, BANK_MAGIC, sizeof(banks->magic));
+    banks->size = sizeof(struct bank);
+    banks->nbanks = BANKS;
+  } else if (memcmp(banks->magic, BANK_MAGIC, sizeof(banks->magic)) ||
+             banks->size != sizeof(struct bank) || banks->nbanks != BANKS) {
+    errprintf("%s is not a bank file\n", filename);
+    banks_close();
+    return -1;
+  }
+
+  for (n = 0; n < BANKS; n++) {
+    if (!banks->bank[n].stored)
+      continue;
+    if (bank_ok(&banks->bank[n])) {
+      router_feedback_build(&bank_feedback[n], banks->bank[n].map);
+      banks_valid |= 1u << n;
+    } else
+      printf("Bank %d in %s is damaged, ignoring it\n", n, filename);
+  }
+  dbgprintf("Opened bank file %s\n", filename);
+
+  return 0;
+}
+
+/* Store bank */
+int
+bank_store(int n, const struct router *router, const struct leds *leds)
+{
+  struct bank *bank;
+
+  if (!banks || n < 0 || n >= BANKS)
+    return -1;
+  bank = &banks->bank[n];
+
+  /* The router may be using this bank's dispatch table already */
+  if (router->map != bank->map) {
+    memcpy(bank->map, router->map, sizeof(bank->map));
+    router_feedback_build(&bank_feedback[n], bank->map);
+  }
+  memcpy(bank->value, router->editmap.value, sizeof(bank->value));
+  memcpy(bank->toggle, router->toggle, sizeof(bank->toggle));
+  memcpy(bank->leds, leds->value, sizeof(bank->leds));
+  memcpy(bank->known, leds->known, sizeof(bank->known));
+  bank->stored = 1;
+  banks_valid |= 1u << n;
+
+  /* Let the kernel write it back in its own time */
+  msync(banks, sizeof(*banks), MS_ASYNC);
+
+  return 0;
+}
+
+/* Recall bank */
+int
+bank_recall(int n, struct router *router, struct leds *leds)
+{
+  const struct bank *bank;
+  int i;
+
+  if (!banks || n < 0 || n >= BANKS || !(banks_valid & (1u << n)))
+    return -1;
+  bank = &banks->bank[n];
+
+  router_set_map(router, bank->map, &bank_feedback[n]);
+  memcpy(router->editmap.value, bank->value, sizeof(router->editmap.value));
+  memcpy(router->toggle, bank->toggle, sizeof(router->toggle));
+
+  /* leds_set() only makes LEDs dirty if they need changing */
+  for (i = 0; i < LEDS / 32; i++) {
+    uint32_t bits = bank->known[i];
+
+    while (bits) {
+      int bit = __builtin_ctz(bits);
+
+      bits &= ~(1u << bit);
+      leds_set(leds, i * 32 + bit, bank->leds[i * 32 + bit]);
+    }
+  }
+
+  return 0;
+}
+
+/* Dispatch table in bank */
+const struct control_map *
+bank_map(int n, const struct router_feedback **feedback)
+{
+  if (!banks || n < 0 || n >= BANKS || !(banks_valid & (1u << n)))
+    return NULL;
+  if (feedback)
+    *feedback = &bank_feedback[n];
+  return banks->bank[n].map;
+}
+
+/* Close bank file */
+void
+banks_close(void)
+{
+  if (!banks)
+    return;
+  msync(banks, sizeof(*banks), MS_SYNC);
+  munmap(banks, sizeof(*banks));
+  banks = NULL;
+  banks_valid = 0;
+}
+
+/**************************** End of file bank.c ***************************/
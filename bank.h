@@ -0,0 +1,76 @@
+/****************************************************************************
+ *
+ * bank.h - preset banks
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _BANK_H_
+#define _BANK_H_
+
+#include <stdint.h>
+
+#include "router.h"
+#include "leds.h"
+
+/* Number of preset banks in bank file */
+#define BANKS BANK_BUTTONS
+
+/* Bank file format: the 8 byte magic "NOCTBNK1", the size of struct bank
+ * and the number of banks (4 bytes each, host byte order), followed by the
+ * banks. The file is memory mapped, so storing a bank saves it right away,
+ * and recalling one doesn't need any file access. */
+#define BANK_MAGIC "NOCTBNK1"
+
+/* Controller state stored in a bank */
+struct bank
+{
+  uint32_t stored;                    /* non-zero if bank is in use */
+  struct control_map map[CONTROLS];   /* dispatch table */
+  int32_t value[EDITMAP_SIZE];        /* edit map, i.e. encoder values */
+  uint8_t toggle[CONTROLS];           /* toggle button states */
+  uint8_t leds[LEDS];                 /* LED values and ring modes */
+  uint32_t known[LEDS / 32];          /* bit set = LED value is used */
+};
+
+/* Open bank file, creating it if it doesn't exist. Return 0 if ok, or
+ * < 0 on failure. */
+int banks_open(const char *filename);
+
+/* Store state of router and LEDs in bank n. Return 0 if ok, < 0 if no bank
+ * file is open or n is out of range. */
+int bank_store(int n, const struct router *router, const struct leds *leds);
+
+/* Recall bank n into router and LEDs. The router uses the dispatch table
+ * in the bank file directly, together with its reverse table prebuilt when
+ * the bank was opened or stored, and only LEDs that differ from what the
+ * Nocturn displays are made dirty. Return 0 if ok, < 0 if there is no such
+ * bank. */
+int bank_recall(int n, struct router *router, struct leds *leds);
+
+/* Return dispatch table in bank n, for router_set_map(), or NULL if there
+ * is no such bank. Unless feedback is NULL, *feedback is set to the reverse
+ * table to go with it. */
+const struct control_map *bank_map(int n,
+                                   const struct router_feedback **feedback);
+
+/* Close bank file. Routers must not use it after this. */
+void banks_close(void);
+
+#endif /* _BANK_H_ */
+
+/**************************** End of file bank.h ***************************/
@@ -0,0 +1,515 @@
+/****************************************************************************
+ *
+ * bench.c - benchmark for the Nocturn data path, no hardware needed
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+/* Synthetic (or recorded) data from the Nocturn is fed through the same
+ * parser and router as in nocturn.c, one USB transfer at a time, with a
+ * fake MIDI backend in place of ALSA. The whole path is run through
+ * device_process_buffer(), exactly as rx_cb() does with the buffers it gets
+ * from libusb, so the USB side needs no faking.
+ * As all transfers are available immediately, the latencies reported are
+ * the processing times only, not including any time spent waiting for
+ * transfers to arrive. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "debug.h"
+#include "capture.h"
+#include "midi.h"
+#include "engine.h"
+#include "parser.h"
+#include "router.h"
+#include "device.h"
+#include "stats.h"
+
+#define BENCH_BUFSIZE CAPTURE_MAXLEN /* max bytes per transfer */
+#define BENCH_RAWSIZE 10      /* bytes per transfer in raw files, as RX_BUFSIZE */
+#define BENCH_PAIRS 4         /* CC's per synthetic transfer */
+#define BENCH_EVENTS 1000000  /* default number of events per profile */
+#define BENCH_BATCH 4         /* default transfers per flush, as RX_TRANSFERS */
+#define BENCH_INTERVAL_US 1000 /* pretend time between transfers */
+
+/* One USB transfer from Nocturn */
+struct transfer {
+  int len;
+  uint8_t data[BENCH_BUFSIZE];
+};
+
+/* Stream of transfers */
+struct stream {
+  int ntransfers;
+  int nevents;
+  struct transfer *transfers;
+};
+
+
+/* Fake MIDI backend, which just counts and discards everything. */
+
+static int queued;
+static long sent;
+static int sink; /* so the values aren't optimized away */
+
+static struct polls *bench_init(void)
+{
+  return calloc(1, sizeof(struct polls));
+}
+
+static int bench_create_port(const char *name)
+{
+  return 0;
+}
+
+static int bench_queue_cc(int port, int channel, int controller, int value,
+                          uint64_t time)
+{
+  sink += channel + controller + value;
+  queued++;
+  return 0;
+}
+
+static int bench_flush(void)
+{
+  sent += queued;
+  queued = 0;
+  return 0;
+}
+
+static void bench_input(void)
+{
+}
+
+static const struct midi_backend bench_backend = {
+  .name = "bench",
+  .init = bench_init,
+  .create_port = bench_create_port,
+  .queue_cc = bench_queue_cc,
+  .flush = bench_flush,
+  .input = bench_input,
+};
+
+
+/* Stress profiles. Each one generates nevents CC's from the Nocturn, packed
+ * BENCH_PAIRS to a transfer, each transfer starting with a status byte. */
+
+/* Simple deterministic pseudo random numbers, so runs are comparable */
+static unsigned rnd_state = 1;
+
+static unsigned rnd(void)
+{
+  rnd_state = rnd_state * 1103515245 + 12345;
+  return (rnd_state >> 16) & 0x7fff;
+}
+
+/* All 8 encoders turned at the same time, mostly in the same direction */
+static void encoders(int i, uint8_t *cc, uint8_t *value)
+{
+  *cc = 64 + i % 8;
+  *value = (rnd() % 8) ? 1 : 127;
+}
+
+/* Slider moved back and forth; the slider also sends CC 73 */
+static void slider(int i, uint8_t *cc, uint8_t *value)
+{
+  int pos = (i / 2) % 254;
+
+  if (i & 1) {
+    *cc = 73;
+    *value = (pos & 1) ? 64 : 0;
+  } else {
+    *cc = 72;
+    *value = pos < 127 ? pos : 253 - pos;
+  }
+}
+
+/* Buttons mashed at random, with the encoder touch sensors jittering */
+static void buttons(int i, uint8_t *cc, uint8_t *value)
+{
+  static uint8_t down[128];
+  int c = (rnd() % 4) ? 112 + rnd() % 16 : 96 + rnd() % 8;
+
+  down[c] = !down[c];
+  *cc = c;
+  *value = down[c] ? 127 : 0;
+}
+
+typedef void (*generator)(int i, uint8_t *cc, uint8_t *value);
+
+static const struct profile {
+  const char *name;
+  generator gen;
+} profiles[] = {
+  { "encoders", encoders },
+  { "slider", slider },
+  { "buttons", buttons },
+  { NULL, NULL }
+};
+
+/* Generate stream for profile */
+static int generate(struct stream *stream, generator gen, int nevents)
+{
+  struct transfer *t;
+  int i;
+
+  stream->ntransfers = (nevents + BENCH_PAIRS - 1) / BENCH_PAIRS;
+  stream->nevents = nevents;
+  stream->transfers = calloc(stream->ntransfers, sizeof(struct transfer));
+  if (!stream->transfers)
+    return -1;
+
+  for (i = 0; i < nevents; i++) {
+    t = &stream->transfers[i / BENCH_PAIRS];
+    if (!t->len)
+      t->data[t->len++] = 0xb0;
+    gen(i, &t->data[t->len], &t->data[t->len + 1]);
+    t->len += 2;
+  }
+
+  return 0;
+}
+
+/* Make room for one more transfer in stream; return it. */
+static struct transfer *add_transfer(struct stream *stream)
+{
+  struct transfer *t;
+
+  if (!(stream->ntransfers % 1024)) {
+    t = realloc(stream->transfers,
+                (stream->ntransfers + 1024) * sizeof(struct transfer));
+    if (!t)
+      return NULL;
+    stream->transfers = t;
+  }
+
+  return &stream->transfers[stream->ntransfers++];
+}
+
+/* Read file recorded from Nocturn: either a capture file made by nocturn
+ * -c, or a raw byte stream, which is split into transfers. The number of
+ * events is found by running it through the parser. */
+static int load(struct stream *stream, const char *filename)
+{
+  struct nocturn_event events[PARSER_MAX_EVENTS(BENCH_BUFSIZE)];
+  struct capture_reader reader;
+  struct capture_record rec;
+  struct parser parser;
+  struct transfer *t;
+  char magic[8];
+  FILE *f;
+  int stat = 0;
+
+  f = fopen(filename, "rb");
+  if (!f) {
+    perror(filename);
+    return -1;
+  }
+  if (fread(magic, sizeof(magic), 1, f) == 1 &&
+      !memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+    fclose(f);
+    f = NULL;
+    if (capture_reader_open(&reader, filename) < 0)
+      return -1;
+  } else
+    rewind(f);
+
+  memset(stream, 0, sizeof(*stream));
+  parser_init(&parser);
+  for (;;) {
+    if (f) {
+      rec.len = fread(rec.data, 1, BENCH_RAWSIZE, f);
+      if (!rec.len)
+        break;
+    } else if ((stat = capture_read(&reader, &rec)) <= 0)
+      break;
+
+    t = add_transfer(stream);
+    if (!t) {
+      stat = -1;
+      break;
+    }
+    t->len = rec.len;
+    memcpy(t->data, rec.data, rec.len);
+    stream->nevents += parser_run(&parser, t->data, t->len, events);
+  }
+
+  if (f)
+    fclose(f);
+  else
+    capture_reader_close(&reader);
+  if (stat < 0)
+    fprintf(stderr, "Couldn't read %s\n", filename);
+  return stat;
+}
+
+
+/* Measurements */
+
+/* Current monotonic time in ns */
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report_throughput(const char *stage, int nevents, uint64_t ns)
+{
+  printf("  %-10s %10.0f events/s %8.1f ns/event\n", stage,
+         ns ? nevents * 1e9 / ns : 0.0, nevents ? (double) ns / nevents : 0);
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void report_latency(uint32_t *latency, int n)
+{
+  if (!n)
+    return;
+  qsort(latency, n, sizeof(*latency), compare_u32);
+  printf("  %-10s p50 %u ns, p99 %u ns, max %u ns\n", "latency",
+         latency[n / 2], latency[n - n / 100 - 1], latency[n - 1]);
+}
+
+/* Parser only */
+static void bench_parser(const struct stream *stream)
+{
+  struct nocturn_event events[PARSER_MAX_EVENTS(BENCH_BUFSIZE)];
+  struct parser parser;
+  uint64_t start;
+  int nevents = 0;
+  int i;
+
+  parser_init(&parser);
+  start = now_ns();
+  for (i = 0; i < stream->ntransfers; i++)
+    nevents += parser_run(&parser, stream->transfers[i].data,
+                          stream->transfers[i].len, events);
+  report_throughput("parser", nevents, now_ns() - start);
+}
+
+/* Router only, on events parsed beforehand */
+static int bench_router(const struct stream *stream)
+{
+  struct nocturn_event *events;
+  int *nevents;
+  struct parser parser;
+  struct router router;
+  uint64_t start;
+  int total = 0;
+  int i;
+
+  events = malloc(stream->ntransfers * PARSER_MAX_EVENTS(BENCH_BUFSIZE) *
+                  sizeof(*events));
+  nevents = malloc(stream->ntransfers * sizeof(*nevents));
+  if (!events || !nevents) {
+    free(events);
+    free(nevents);
+    return -1;
+  }
+
+  parser_init(&parser);
+  for (i = 0; i < stream->ntransfers; i++)
+    nevents[i] = parser_run(&parser, stream->transfers[i].data,
+                            stream->transfers[i].len,
+                            &events[i * PARSER_MAX_EVENTS(BENCH_BUFSIZE)]);
+
+  router_init(&router, midi_default_port());
+  start = now_ns();
+  for (i = 0; i < stream->ntransfers; i++) {
+    if (!nevents[i])
+      continue;
+    route_events(&router, &events[i * PARSER_MAX_EVENTS(BENCH_BUFSIZE)],
+                 nevents[i], (uint64_t) i * BENCH_INTERVAL_US);
+    total += nevents[i];
+  }
+  report_throughput("router", total, now_ns() - start);
+  midi_flush();
+
+  free(events);
+  free(nevents);
+  return 0;
+}
+
+/* LED frame timer handler. Nothing makes the LEDs change here, and there
+ * is nowhere to send them. */
+static void bench_led_frame(void *data)
+{
+}
+
+/* Whole path, as rx_cb() and the main loop: device_process_buffer(), and
+ * flush MIDI every batch transfers. Latency is from starting to process a
+ * transfer until the MIDI it generated has been flushed. */
+static int bench_pipeline(const struct stream *stream, int batch)
+{
+  struct device *device;
+  uint32_t *latency;
+  uint64_t *arrived;
+  int *waiting;
+  uint64_t start, t;
+  int nlatency = 0;
+  int total = 0;
+  char stage[16];
+  int i, j, n;
+  int stat = -1;
+
+  device = malloc(sizeof(*device));
+  latency = malloc((stream->nevents + 1) * sizeof(*latency));
+  arrived = malloc(batch * sizeof(*arrived));
+  waiting = malloc(batch * sizeof(*waiting));
+  if (!device || !latency || !arrived || !waiting)
+    goto out;
+  if (device_init(device, 1, midi_default_port(), bench_led_frame,
+                  device) < 0)
+    goto out;
+
+  start = now_ns();
+  for (i = 0; i < stream->ntransfers; i++) {
+    arrived[i % batch] = now_ns();
+    n = device_process_buffer(device, stream->transfers[i].data,
+                              stream->transfers[i].len,
+                              (uint64_t) i * BENCH_INTERVAL_US);
+    waiting[i % batch] = n;
+    total += n;
+
+    if (i % batch == batch - 1 || i == stream->ntransfers - 1) {
+      midi_flush();
+      stats_flushed(engine_now());
+      t = now_ns();
+      for (j = 0; j <= i % batch; j++)
+        for (n = 0; n < waiting[j] && nlatency < stream->nevents; n++)
+          latency[nlatency++] = t - arrived[j];
+    }
+  }
+  snprintf(stage, sizeof(stage), "batch %d", batch);
+  report_throughput(stage, total, now_ns() - start);
+  report_latency(latency, nlatency);
+  stat = 0;
+
+out:
+  free(device);
+  free(latency);
+  free(arrived);
+  free(waiting);
+  return stat;
+}
+
+static int run(const char *name, const struct stream *stream, int batch)
+{
+  printf("%s: %d events in %d transfers\n", name, stream->nevents,
+         stream->ntransfers);
+  bench_parser(stream);
+  if (bench_router(stream) < 0 ||
+      bench_pipeline(stream, 1) < 0 ||
+      (batch > 1 && bench_pipeline(stream, batch) < 0)) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+void usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [-p <profile>] [-n <events>] [-b <transfers>] "
+                  "[-f <file>]\n", progname);
+  fprintf(stderr, "  -p <profile>    encoders, slider or buttons "
+                  "(default all)\n");
+  fprintf(stderr, "  -n <events>     Events per profile (default %d)\n",
+          BENCH_EVENTS);
+  fprintf(stderr, "  -b <transfers>  Transfers per MIDI flush, for the "
+                  "batched run (default %d)\n", BENCH_BATCH);
+  fprintf(stderr, "  -f <file>       Use raw data recorded from Nocturn "
+                  "instead of a profile\n");
+}
+
+int main(int argc, char **argv)
+{
+  const struct profile *profile;
+  const char *profile_name = NULL;
+  const char *filename = NULL;
+  struct stream stream;
+  int nevents = BENCH_EVENTS;
+  int batch = BENCH_BATCH;
+  int found = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:n:b:f:")) != -1) {
+    switch (opt) {
+      case 'p':
+        profile_name = optarg;
+        break;
+      case 'n':
+        nevents = atoi(optarg);
+        break;
+      case 'b':
+        batch = atoi(optarg);
+        break;
+      case 'f':
+        filename = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (nevents < 1 || batch < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  midi_set_backend(&bench_backend);
+  if (engine_init() < 0 || !midi_init())
+    return 2;
+
+  if (filename) {
+    if (load(&stream, filename) < 0 || run(filename, &stream, batch) < 0)
+      return 2;
+    free(stream.transfers);
+    return 0;
+  }
+
+  for (profile = profiles; profile->name; profile++) {
+    if (profile_name && strcmp(profile_name, profile->name))
+      continue;
+    if (generate(&stream, profile->gen, nevents) < 0 ||
+        run(profile->name, &stream, batch) < 0)
+      return 2;
+    free(stream.transfers);
+    found++;
+  }
+  if (!found) {
+    fprintf(stderr, "Unknown profile %s\n", profile_name);
+    return 1;
+  }
+
+  printf("%ld CC's sent to MIDI backend\n", sent);
+  return 0;
+}
+
+/*************************** End of file bench.c ****************************/
@@ -0,0 +1,195 @@
+/****************************************************************************
+ *
+ * capture.c - recording and replaying data received from Nocturn
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include <string.h>
+
+#include "capture.h"
+#include "spsc.h"
+#include "debug.h"
+
+/* Max number of records waiting to be written. At most a few transfers
+ * per millisecond arrive from each Nocturn, and the ring is drained once
+ * per main loop pass, so this gives plenty of headroom. */
+#define CAPTURE_RING 4096
+
+/* stdio buffer for capture file, so that there are few write() calls */
+#define CAPTURE_BUFSIZE 65536
+
+/* Size of record header in file */
+#define CAPTURE_HEADER 6
+
+static FILE *capture_file;
+static struct spsc capture_ring;
+static uint64_t capture_last;  /* time of last record written */
+static int capture_started;    /* capture_last is valid */
+static int capture_lost;       /* records dropped because ring was full */
+static char capture_buf[CAPTURE_BUFSIZE];
+
+/* Start capture */
+int
+capture_open(const char *filename)
+{
+  if (spsc_init(&capture_ring, CAPTURE_RING,
+                sizeof(struct capture_record)) < 0)
+    return -1;
+
+  capture_file = fopen(filename, "wb");
+  if (!capture_file) {
+    errprintf("Can't open capture file %s\n", filename);
+    spsc_free(&capture_ring);
+    return -1;
+  }
+  setvbuf(capture_file, capture_buf, _IOFBF, sizeof(capture_buf));
+
+  if (fwrite(CAPTURE_MAGIC, 8, 1, capture_file) != 1) {
+    capture_close();
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Capture transfer */
+void
+capture_rx(int device, uint64_t time, const uint8_t *data, int len)
+{
+  struct capture_record rec;
+
+  if (!capture_file)
+    return;
+
+  if (len > CAPTURE_MAXLEN)
+    len = CAPTURE_MAXLEN;
+  rec.time = time;
+  rec.device = device;
+  rec.len = len;
+  memcpy(rec.data, data, len);
+  if (spsc_push(&capture_ring, &rec) < 0)
+    __atomic_add_fetch(&capture_lost, 1, __ATOMIC_RELAXED);
+}
+
+/* Write captured records */
+void
+capture_drain(void)
+{
+  struct capture_record rec;
+  uint8_t header[CAPTURE_HEADER];
+  uint32_t delta;
+  int lost;
+
+  if (!capture_file)
+    return;
+
+  while (!spsc_pop(&capture_ring, &rec)) {
+    if (!capture_started) {
+      capture_last = rec.time;
+      capture_started = 1;
+    }
+    /* A gap of more than an hour or so just gets shortened */
+    delta = rec.time - capture_last > UINT32_MAX ?
+            UINT32_MAX : rec.time - capture_last;
+    capture_last = rec.time;
+
+    memcpy(header, &delta, 4);
+    header[4] = rec.device;
+    header[5] = rec.len;
+    if (fwrite(header, sizeof(header), 1, capture_file) != 1 ||
+        (rec.len && fwrite(rec.data, rec.len, 1, capture_file) != 1)) {
+      errprintf("Writing capture file failed, stopping capture\n");
+      capture_close();
+      return;
+    }
+  }
+
+  lost = __atomic_exchange_n(&capture_lost, 0, __ATOMIC_RELAXED);
+  if (lost)
+    printf("%d transfers not captured, capture ring full\n", lost);
+}
+
+/* Stop capture */
+void
+capture_close(void)
+{
+  FILE *f = capture_file;
+
+  if (!f)
+    return;
+  capture_drain();
+  capture_file = NULL;
+  fclose(f);
+  spsc_free(&capture_ring);
+}
+
+/* Open capture file for reading */
+int
+capture_reader_open(struct capture_reader *reader, const char *filename)
+{
+  char magic[8];
+
+  reader->time = 0;
+  reader->f = fopen(filename, "rb");
+  if (!reader->f) {
+    errprintf("Can't open capture file %s\n", filename);
+    return -1;
+  }
+
+  if (fread(magic, sizeof(magic), 1, reader->f) != 1 ||
+      memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+    errprintf("%s is not a capture file\n", filename);
+    capture_reader_close(reader);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Read next record */
+int
+capture_read(struct capture_reader *reader, struct capture_record *rec)
+{
+  uint8_t header[CAPTURE_HEADER];
+  uint32_t delta;
+
+  if (fread(header, sizeof(header), 1, reader->f) != 1)
+    return feof(reader->f) ? 0 : -1;
+
+  memcpy(&delta, header, 4);
+  reader->time += delta;
+  rec->time = reader->time;
+  rec->device = header[4];
+  rec->len = header[5];
+  if (rec->len > CAPTURE_MAXLEN ||
+      fread(rec->data, 1, rec->len, reader->f) != rec->len)
+    return -1; /* corrupt or truncated */
+
+  return 1;
+}
+
+/* Close capture file */
+void
+capture_reader_close(struct capture_reader *reader)
+{
+  if (reader->f)
+    fclose(reader->f);
+  reader->f = NULL;
+}
+
+/************************** End of file capture.c ***************************/
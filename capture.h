@@ -0,0 +1,80 @@
+/****************************************************************************
+ *
+ * capture.h - recording and replaying data received from Nocturn
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Capture file format: the 8 byte magic "NOCTCAP1", followed by one record
+ * per USB transfer received:
+ *   4 bytes  microseconds since previous record (host byte order)
+ *   1 byte   device index (1 = first Nocturn)
+ *   1 byte   length of data
+ *   n bytes  data, exactly as received from the Nocturn
+ */
+#define CAPTURE_MAGIC "NOCTCAP1"
+#define CAPTURE_MAXLEN 32 /* max data bytes per record; longer is cut */
+
+/* One record, as read from capture file */
+struct capture_record
+{
+  uint64_t time;   /* us since start of capture */
+  uint8_t device;
+  uint8_t len;
+  uint8_t data[CAPTURE_MAXLEN];
+};
+
+/* Start capturing to filename. Return 0 if ok, -1 if failure. */
+int capture_open(const char *filename);
+
+/* Capture transfer received from device at time (us). Never blocks: the
+ * record is put in a lock-free ring, and written to the file by the next
+ * capture_drain(). Can be called from the USB thread. Does nothing if no
+ * capture is open. */
+void capture_rx(int device, uint64_t time, const uint8_t *data, int len);
+
+/* Write captured records to file. Main loop only. */
+void capture_drain(void);
+
+/* Write everything and close capture file. */
+void capture_close(void);
+
+/* Capture file being read */
+struct capture_reader
+{
+  FILE *f;
+  uint64_t time; /* time of last record read */
+};
+
+/* Open capture file for reading. Return 0 if ok, -1 if failure. */
+int capture_reader_open(struct capture_reader *reader, const char *filename);
+
+/* Read next record. Return 1 if ok, 0 at end of file, -1 if failure. */
+int capture_read(struct capture_reader *reader, struct capture_record *rec);
+
+/* Close capture file */
+void capture_reader_close(struct capture_reader *reader);
+
+#endif /* _CAPTURE_H_ */
+
+/************************** End of file capture.h ***************************/
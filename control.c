@@ -0,0 +1,361 @@
+/****************************************************************************
+ *
+ * control.c - runtime control socket and service manager notification
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#define _GNU_SOURCE /* for accept4() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "engine.h"
+#include "debug.h"
+
+/* Max number of clients connected at the same time */
+#define CONTROL_CLIENTS 8
+
+/* Max number of words in a command line */
+#define CONTROL_ARGS 8
+
+/* First fd passed by the service manager */
+#define LISTEN_FDS_START 3
+
+/* Connected client, with any incomplete command line received so far */
+struct control_client
+{
+  int fd;
+  int len;
+  int overflow;             /* line too long, skipping to its end */
+  char line[CONTROL_LINE];
+};
+
+static int listen_fd = -1;
+static int activated;       /* listen_fd was passed by service manager */
+static struct sockaddr_un addr;
+static const struct control_command *command_table;
+static struct control_client *clients[CONTROL_CLIENTS];
+
+static int notify_fd = -1;
+static struct sockaddr_un notify_addr;
+static socklen_t notify_len;
+
+/* List commands */
+static int
+control_help(FILE *out)
+{
+  const struct control_command *cmd;
+
+  for (cmd = command_table; cmd->name; cmd++)
+    fprintf(out, "%s %s\n  %s\n", cmd->name, cmd->args ? cmd->args : "",
+            cmd->help);
+  fprintf(out, "help\n  List commands\n");
+
+  return 0;
+}
+
+/* Carry out command line, and send reply to client. Like the metrics
+ * socket, we never wait for the client: if it doesn't have room for the
+ * reply, it gets what fits. */
+static void
+control_run(struct control_client *client, char *line)
+{
+  char reply[CONTROL_REPLY];
+  char *argv[CONTROL_ARGS + 1];
+  const struct control_command *cmd;
+  char *save;
+  FILE *out;
+  int argc = 0;
+  int stat = -1;
+  long len;
+
+  for (argv[0] = strtok_r(line, " \t\r", &save);
+       argv[argc] && argc < CONTROL_ARGS;
+       argv[++argc] = strtok_r(NULL, " \t\r", &save))
+    ;
+  if (!argc)
+    return; /* empty line */
+
+  out = fmemopen(reply, sizeof(reply), "w");
+  if (!out)
+    return;
+
+  dbgprintf("Control command: %s\n", argv[0]);
+  if (!strcmp(argv[0], "help"))
+    stat = control_help(out);
+  else {
+    for (cmd = command_table; cmd->name; cmd++)
+      if (!strcmp(cmd->name, argv[0]))
+        break;
+    if (cmd->name)
+      stat = cmd->handler(argc, argv, out);
+    else
+      fprintf(out, "Unknown command %s, try help\n", argv[0]);
+  }
+  fprintf(out, "%s\n", stat < 0 ? "failed" : "ok");
+
+  /* If the reply was cut short, at least end it with a newline */
+  fflush(out);
+  len = ftell(out);
+  fclose(out);
+  if (len >= (long)sizeof(reply) - 1) {
+    len = sizeof(reply) - 1;
+    reply[len - 1] = '\n';
+  }
+
+  if (send(client->fd, reply, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    dbgprintf("Sending control reply: %s\n", strerror(errno));
+}
+
+/* Drop client */
+static void
+control_close(struct control_client *client)
+{
+  int i;
+
+  for (i = 0; i < CONTROL_CLIENTS; i++)
+    if (clients[i] == client)
+      clients[i] = NULL;
+  engine_del_fd(client->fd);
+  close(client->fd);
+  free(client);
+}
+
+/* Called by engine when client has sent something */
+static void
+control_input(int fd, uint32_t events, void *data)
+{
+  struct control_client *client = data;
+  char buf[CONTROL_LINE];
+  ssize_t n;
+  int i;
+
+  while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    for (i = 0; i < n; i++) {
+      if (buf[i] != '\n') {
+        if (client->len < CONTROL_LINE - 1)
+          client->line[client->len++] = buf[i];
+        else
+          client->overflow = 1;
+        continue;
+      }
+      client->line[client->len] = '\0';
+      if (client->overflow) {
+        static const char toolong[] = "Command too long\nfailed\n";
+
+        send(fd, toolong, sizeof(toolong) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+      } else
+        control_run(client, client->line);
+      client->len = 0;
+      client->overflow = 0;
+    }
+  }
+
+  if (!n || (errno != EAGAIN && errno != EWOULDBLOCK))
+    control_close(client);
+}
+
+/* Called by engine when there are clients waiting */
+static void
+control_accept(int fd, uint32_t events, void *data)
+{
+  struct control_client *client;
+  int cfd;
+  int i;
+
+  while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    for (i = 0; i < CONTROL_CLIENTS; i++)
+      if (!clients[i])
+        break;
+    client = i < CONTROL_CLIENTS ? calloc(1, sizeof(*client)) : NULL;
+    if (!client) {
+      dbgprintf("Too many control clients\n");
+      close(cfd);
+      continue;
+    }
+    client->fd = cfd;
+    if (engine_add_fd(cfd, EPOLLIN | EPOLLRDHUP | EPOLLET, control_input,
+                      client) < 0) {
+      close(cfd);
+      free(client);
+      continue;
+    }
+    clients[i] = client;
+    /* The command may already be waiting */
+    control_input(cfd, EPOLLIN, client);
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK)
+    errprintf("Accepting control connection: %s\n", strerror(errno));
+}
+
+/* Take listening socket passed by service manager, if any.
+ * Return fd, or -1 if none. */
+static int
+listen_fds(void)
+{
+  const char *pid = getenv("LISTEN_PID");
+  const char *fds = getenv("LISTEN_FDS");
+  int fd = LISTEN_FDS_START;
+
+  if (!pid || !fds || atoi(pid) != getpid() || atoi(fds) < 1)
+    return -1;
+
+  /* Not for any children of ours */
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+      fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+    errprintf("Bad control socket from service manager: %s\n",
+              strerror(errno));
+    return -1;
+  }
+  if (atoi(fds) > 1)
+    printf("Using the first of %s sockets from service manager\n", fds);
+
+  return fd;
+}
+
+/* Set up control socket */
+int
+control_init(const char *path, const struct control_command *commands)
+{
+  command_table = commands;
+
+  listen_fd = listen_fds();
+  if (listen_fd >= 0) {
+    activated = 1;
+    dbgprintf("Control socket passed by service manager\n");
+    goto listening;
+  }
+  if (!path)
+    return 0;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errprintf("Control socket path too long: %s\n", path);
+    return -1;
+  }
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    errprintf("Couldn't create control socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path); /* left over from last time */
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, 8) < 0) {
+    errprintf("Couldn't listen on %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+listening:
+  if (engine_add_fd(listen_fd, EPOLLIN | EPOLLET, control_accept, NULL) < 0)
+    goto fail;
+
+  return 0;
+
+fail:
+  close(listen_fd);
+  listen_fd = -1;
+  return -1;
+}
+
+/* Close control socket */
+void
+control_exit(void)
+{
+  int i;
+
+  for (i = 0; i < CONTROL_CLIENTS; i++)
+    if (clients[i])
+      control_close(clients[i]);
+
+  if (listen_fd < 0)
+    return;
+  engine_del_fd(listen_fd);
+  close(listen_fd);
+  /* A socket from the service manager stays around for the next time */
+  if (!activated)
+    unlink(addr.sun_path);
+  listen_fd = -1;
+}
+
+/* Set up notifications */
+int
+control_notify_init(void)
+{
+  const char *path = getenv("NOTIFY_SOCKET");
+  int len;
+
+  if (!path || (path[0] != '/' && path[0] != '@'))
+    return 0;
+  len = strlen(path);
+  if (len >= (int)sizeof(notify_addr.sun_path)) {
+    errprintf("Notify socket path too long: %s\n", path);
+    return 0;
+  }
+
+  notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (notify_fd < 0) {
+    errprintf("Couldn't create notify socket: %s\n", strerror(errno));
+    return 0;
+  }
+
+  notify_addr.sun_family = AF_UNIX;
+  memcpy(notify_addr.sun_path, path, len);
+  if (path[0] == '@')
+    notify_addr.sun_path[0] = '\0'; /* abstract namespace */
+  notify_len = offsetof(struct sockaddr_un, sun_path) + len;
+
+  return 1;
+}
+
+/* Notify service manager */
+void
+control_notify(const char *fmt, ...)
+{
+  char buf[CONTROL_LINE];
+  va_list ap;
+  int len;
+
+  if (notify_fd < 0)
+    return;
+
+  va_start(ap, fmt);
+  len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (len >= (int)sizeof(buf))
+    len = sizeof(buf) - 1;
+
+  if (sendto(notify_fd, buf, len, MSG_NOSIGNAL,
+             (struct sockaddr *)&notify_addr, notify_len) < 0)
+    dbgprintf("Notifying service manager: %s\n", strerror(errno));
+}
+
+/************************** End of file control.c **************************/
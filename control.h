@@ -0,0 +1,67 @@
+/****************************************************************************
+ *
+ * control.h - runtime control socket and service manager notification
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include <stdio.h>
+
+/* Max length of command line, and of reply to one command */
+#define CONTROL_LINE 256
+#define CONTROL_REPLY 4096
+
+/* Command handler. argv[0] is the command itself. Any reply text is
+ * written to out. Return 0 if ok, < 0 if the command failed. */
+typedef int (*control_handler)(int argc, char **argv, FILE *out);
+
+/* Control command */
+struct control_command
+{
+  const char *name;
+  const char *args;    /* argument synopsis, for help, or NULL */
+  const char *help;
+  control_handler handler;
+};
+
+/* Serve control commands on Unix socket path, or on the socket passed by
+ * the service manager (LISTEN_FDS) if any, in which case path may be NULL.
+ * Clients send one command per line, and each command is answered with
+ * the reply text followed by a line "ok" or "failed". "help" lists the
+ * commands in the table, which is terminated by an entry with a NULL
+ * name. Requires engine_init() to have been called. Return 0 if ok, -1 if
+ * failure. */
+int control_init(const char *path, const struct control_command *commands);
+
+/* Close control socket and any clients */
+void control_exit(void);
+
+/* Enable notifications to the service manager, if it has given us a
+ * NOTIFY_SOCKET. Return 1 if notifications will be sent, 0 if not. */
+int control_notify_init(void);
+
+/* Send notification to the service manager, in sd_notify() format, e.g.
+ * "READY=1". Does nothing unless control_notify_init() found a socket. */
+void control_notify(const char *fmt, ...)
+  __attribute__((format(printf, 1, 2)));
+
+#endif /* _CONTROL_H_ */
+
+/************************** End of file control.h **************************/
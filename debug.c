@@ -22,6 +22,8 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
 #include "debug.h"
 
 /* Global switch for debug outputs (assuming DEBUG is enabled). */
@@ -45,4 +47,140 @@ int dbgprintf(const char *fmt, ...)
 }
 #endif
 
+/* Log ring.
+ * Records may be stored from several threads at once, so each slot has a
+ * sequence number telling whether it is free for writing (seq == position
+ * claimed by writer) or ready for printing (seq == position + 1). A writer
+ * claims a slot by advancing log_head with compare-and-swap, fills it in,
+ * and then publishes it by updating its sequence number. The background
+ * thread is the only reader, so log_tail needs no atomic updates. */
+#define LOG_RECORDS 1024      /* power of two */
+#define LOG_POLL_NS 10000000  /* check ring every 10 ms when idle */
+
+struct log_record {
+  unsigned seq;
+  const char *fmt;
+  int args[LOG_ARGS];
+};
+
+static struct log_record log_ring[LOG_RECORDS];
+static unsigned log_head;     /* next slot to be claimed by a writer */
+static unsigned log_tail;     /* next slot to be printed */
+static unsigned log_lost;     /* records dropped because ring was full */
+static int log_running;       /* background thread is running */
+static int log_quit;
+static pthread_t log_thread;
+
+/* Print one record */
+static void log_print(const char *fmt, const int *a)
+{
+  /* Unused arguments are simply ignored by fprintf */
+  fprintf(stderr, fmt, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+/* Store record in ring, or print it directly if there's no thread yet */
+void log_record(const char *fmt, int nargs, ...)
+{
+  struct log_record *rec;
+  int args[LOG_ARGS] = { 0 };
+  unsigned pos, seq;
+  va_list ap;
+  int i;
+
+  va_start(ap, nargs);
+  for (i = 0; i < nargs && i < LOG_ARGS; i++)
+    args[i] = va_arg(ap, int);
+  va_end(ap);
+
+  if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+    log_print(fmt, args);
+    return;
+  }
+
+  pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+  for (;;) {
+    rec = &log_ring[pos % LOG_RECORDS];
+    seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      /* On failure, pos is updated to the current head */
+      if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if ((int)(seq - pos) < 0) {
+      /* Slot not printed yet since last time round: ring is full */
+      __atomic_add_fetch(&log_lost, 1, __ATOMIC_RELAXED);
+      return;
+    } else /* another writer got here first */
+      pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+  }
+
+  rec->fmt = fmt;
+  for (i = 0; i < LOG_ARGS; i++)
+    rec->args[i] = args[i];
+  __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* Print all records in ring. Return number of records printed. */
+static int log_drain(void)
+{
+  struct log_record *rec;
+  unsigned lost;
+  int printed = 0;
+
+  for (;;) {
+    rec = &log_ring[log_tail % LOG_RECORDS];
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != log_tail + 1)
+      break;
+    log_print(rec->fmt, rec->args);
+    /* Free slot for the writer that comes round to it next time */
+    __atomic_store_n(&rec->seq, log_tail + LOG_RECORDS, __ATOMIC_RELEASE);
+    log_tail++;
+    printed++;
+  }
+
+  lost = __atomic_exchange_n(&log_lost, 0, __ATOMIC_RELAXED);
+  if (lost)
+    fprintf(stderr, "(%u log messages lost)\n", lost);
+
+  return printed;
+}
+
+/* Background thread: print records as they turn up */
+static void *log_thread_run(void *data)
+{
+  struct timespec idle = { 0, LOG_POLL_NS };
+
+  while (!__atomic_load_n(&log_quit, __ATOMIC_ACQUIRE))
+    if (!log_drain())
+      nanosleep(&idle, NULL);
+  log_drain();
+
+  return NULL;
+}
+
+/* Start background thread */
+int log_init(void)
+{
+  unsigned i;
+
+  for (i = 0; i < LOG_RECORDS; i++)
+    log_ring[i].seq = i;
+
+  if (pthread_create(&log_thread, NULL, log_thread_run, NULL))
+    return -1;
+  __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/* Stop background thread */
+void log_exit(void)
+{
+  if (!log_running)
+    return;
+  __atomic_store_n(&log_quit, 1, __ATOMIC_RELEASE);
+  pthread_join(log_thread, NULL);
+  log_running = 0;
+}
+
 /***************************** End of file debug.c **************************/
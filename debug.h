@@ -26,6 +26,11 @@
 /* Undef this if we want to disable all potential debug printouts. */
 #define DEBUG
 
+/* Debug levels, for the global 'debug' */
+#define LOG_QUIET 0   /* no debug printouts */
+#define LOG_DEBUG 1   /* setup and other infrequent things */
+#define LOG_EVENTS 2  /* every event from the Nocturn or the host */
+
 /* Debug printouts, conditional on DEBUG && debug */
 #ifdef DEBUG
 int dbgprintf(const char *fmt, ...);
@@ -33,11 +38,46 @@ int dbgprintf(const char *fmt, ...);
 #define dbgprintf(...)
 #endif
 
+/* Asynchronous debug printouts, for use in places where we can't afford to
+ * wait for stdio, such as when handling every event. Instead of being
+ * printed directly, the format and arguments are stored as a fixed size
+ * record in a lock-free ring, which is printed by a background thread. As
+ * only the pointer to the format is stored, it must be a string literal,
+ * and there can be at most LOG_ARGS arguments, all of them ints. If the
+ * ring is full, the record is dropped rather than waiting. When level is
+ * above the current debug level, this costs one compare. */
+#define LOG_ARGS 6
+
+#ifdef DEBUG
+#define logprintf(level, fmt, ...) \
+  do { \
+    if (debug >= (level)) \
+      log_record(fmt, LOG_NARGS(__VA_ARGS__), ##__VA_ARGS__); \
+  } while (0)
+#else
+#define logprintf(...)
+#endif
+
+/* Count arguments, 0..LOG_ARGS */
+#define LOG_NARGS(...) LOG_NARGS_(0, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, n, ...) n
+
+/* Store record in log ring. Use logprintf() rather than calling this. */
+void log_record(const char *fmt, int nargs, ...)
+  __attribute__((format(printf, 1, 3)));
+
+/* Start background thread for printing log records. Until this is called,
+ * logprintf() prints directly. Return 0 if ok, -1 if failure. */
+int log_init(void);
+
+/* Print any remaining log records, and stop background thread. */
+void log_exit(void);
+
 /* Error/warning printouts, active at all times. */
 #define errprintf(...) fprintf(stderr, __VA_ARGS__)
 
-/* Global debug enable/disable */
-int debug;
+/* Global debug level, LOG_foo */
+extern int debug;
 
 #endif /* _DEBUG_H_ */
 
@@ -0,0 +1,163 @@
+/****************************************************************************
+ *
+ * device.c - data path of one Nocturn, from its input to MIDI output
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "device.h"
+#include "stats.h"
+#include "metrics.h"
+#include "bank.h"
+#include "debug.h"
+
+/* Hand-off of events to another thread, NULL = route right away */
+device_handoff_handler device_handoff = NULL;
+
+/* Arm router timer for the next debounced control to become stable, or
+ * MIDI held back by the rate limit to be sent, if any, at time now */
+static void
+router_timer_arm(struct device *device, uint64_t now)
+{
+  uint64_t deadline = router_deadline(&device->router);
+
+  if (deadline == device->router_deadline)
+    return;
+  device->router_deadline = deadline;
+  if (!deadline)
+    engine_timer_stop(device->router_timer);
+  else
+    engine_timer_start(device->router_timer,
+                       deadline > now ? deadline - now : 1, 0);
+}
+
+/* Called when router timer expires: pass on controls that have become
+ * stable, and MIDI held back. The deadline is used as the time, rather
+ * than engine_now(), so that replaying a capture gives the same result
+ * however fast it is done. */
+static void
+router_timer_expired(void *data)
+{
+  struct device *device = data;
+  uint64_t now = device->router_deadline;
+
+  device->router_deadline = 0;
+  if (router_expire(&device->router, now) > 0)
+    stats_queued(now);
+  router_timer_arm(device, now);
+}
+
+/* Set up device */
+int
+device_init(struct device *device, int index, int port,
+            engine_timer_handler led_frame, void *data)
+{
+  memset(device, 0, sizeof(*device));
+  device->index = index;
+  device->bank = -1;
+  parser_init(&device->parser);
+  router_init(&device->router, port);
+  leds_init(&device->leds);
+
+  device->led_timer = engine_timer_new(led_frame, data);
+  if (!device->led_timer)
+    return -1;
+  device->router_timer = engine_timer_new(router_timer_expired, device);
+  if (!device->router_timer)
+    return -1;
+
+  return 0;
+}
+
+/* Arm LED frame timer */
+void
+device_led_timer_arm(struct device *device)
+{
+  if (!device->led_timer_armed && leds_dirty(&device->leds)) {
+    engine_timer_start(device->led_timer, LED_FRAME_US, 0);
+    device->led_timer_armed = 1;
+  }
+}
+
+/* Recall preset bank */
+void
+device_bank_select(struct device *device, int n)
+{
+  if (bank_recall(n, &device->router, &device->leds) < 0) {
+    printf("No bank %d to recall on Nocturn %d\n", n, device->index);
+    return;
+  }
+  dbgprintf("Recalled bank %d on Nocturn %d\n", n, device->index);
+  device->bank = n;
+  device_led_timer_arm(device);
+}
+
+/* Carry out bank recall or store requested using the bank button */
+static void
+bank_check(struct device *device)
+{
+  int request = router_bank_request(&device->router);
+  int n = request & ~BANK_STORE;
+
+  if (request < 0)
+    return;
+  if (!(request & BANK_STORE))
+    device_bank_select(device, n);
+  else if (bank_store(n, &device->router, &device->leds) < 0)
+    printf("Couldn't store bank %d, no bank file\n", n);
+  else
+    printf("Stored bank %d from Nocturn %d\n", n, device->index);
+}
+
+/* Route events */
+void
+device_route(struct device *device, const struct nocturn_event *events,
+             int nevents, uint64_t rx, uint64_t now)
+{
+  stats_record(STATS_QUEUE, now - rx);
+  if (route_events(&device->router, events, nevents, rx) > 0)
+    stats_queued(rx);
+  router_timer_arm(device, rx);
+  bank_check(device);
+}
+
+/* Process buffer of data from device */
+int
+device_process_buffer(struct device *device, const uint8_t *data, int len,
+                      uint64_t rx)
+{
+  struct nocturn_event events[PARSER_MAX_EVENTS(len)];
+  int nevents;
+
+  metrics_add(METRIC_RX_BYTES, len);
+  nevents = parser_run(&device->parser, data, len, events);
+  if (!nevents)
+    return 0;
+  metrics_add(METRIC_EVENTS, nevents);
+
+  if (device_handoff)
+    device_handoff(device, events, nevents, rx);
+  else
+    device_route(device, events, nevents, rx, engine_now());
+
+  return nevents;
+}
+
+/************************** End of file device.c ***************************/
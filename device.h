@@ -0,0 +1,86 @@
+/****************************************************************************
+ *
+ * device.h - data path of one Nocturn, from its input to MIDI output
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _DEVICE_H_
+#define _DEVICE_H_
+
+#include <stdint.h>
+
+#include "engine.h"
+#include "parser.h"
+#include "router.h"
+#include "leds.h"
+
+/* The part of a Nocturn that doesn't depend on USB: the state of its
+ * controls and LEDs, and the path from the data received from it to MIDI
+ * output, including the router timer and preset banks. nocturn-bench
+ * drives the same code as nocturn, without any hardware. */
+struct device
+{
+  int index;            /* 1 for first device found, etc */
+  struct parser parser; /* state for data received from device */
+  struct router router; /* state of controls on device */
+  struct leds leds;     /* LED state of device */
+  struct engine_timer *led_timer; /* LED frame timer */
+  int led_timer_armed;
+  struct engine_timer *router_timer; /* for debouncing and rate limit */
+  uint64_t router_deadline;          /* when it's due, 0 = not armed */
+  int bank;             /* bank last recalled, or -1 if none */
+};
+
+/* Events handler, for passing events parsed by device_process_buffer() on
+ * to another thread, which routes them with device_route(). */
+typedef void (*device_handoff_handler)(struct device *device,
+                                       const struct nocturn_event *events,
+                                       int nevents, uint64_t rx);
+
+/* Set before receiving to hand off events rather than routing them right
+ * away; NULL (default) = route right away. */
+extern device_handoff_handler device_handoff;
+
+/* Set up device number index, with port as its own MIDI output. led_frame
+ * is called with data when the LED frame timer expires, and should send
+ * the LEDs that have changed. Return 0 if ok, < 0 on failure. */
+int device_init(struct device *device, int index, int port,
+                engine_timer_handler led_frame, void *data);
+
+/* Process buffer of len bytes of data from device, received at time rx
+ * (us): parse it, and route the events or hand them off. Return number of
+ * events parsed. */
+int device_process_buffer(struct device *device, const uint8_t *data,
+                          int len, uint64_t rx);
+
+/* Route events received from device at time rx (us), and carry out any
+ * bank request made with them. now is the time they are routed, for the
+ * statistics. */
+void device_route(struct device *device, const struct nocturn_event *events,
+                  int nevents, uint64_t rx, uint64_t now);
+
+/* Arm LED frame timer if any LEDs need sending and it isn't armed */
+void device_led_timer_arm(struct device *device);
+
+/* Recall preset bank n on device. The LEDs that change go out with the
+ * next LED frame. */
+void device_bank_select(struct device *device, int n);
+
+#endif /* _DEVICE_H_ */
+
+/************************** End of file device.h ***************************/
@@ -0,0 +1,114 @@
+/****************************************************************************
+ *
+ * editmap.c - conversion of relative incrementor values to absolute values
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include <string.h>
+
+#include "editmap.h"
+
+/* If an incrementor hasn't been moved for this long, we consider it to be
+ * starting from standstill, with no acceleration. */
+#define ACCEL_IDLE_US 200000
+
+/* Point on acceleration curve: when the incrementor is turned at least
+ * rate increments per second, each increment is multiplied by mult. */
+struct accel_point
+{
+  int rate;
+  int mult;
+};
+
+/* Acceleration curves, terminated by a point with mult 0. The Nocturn
+ * itself sends increments of 2, 3, etc when turned fast, which are included
+ * in the rate. */
+static const struct accel_point accel_none[] = {
+  { 0, 1 }, { 0, 0 }
+};
+static const struct accel_point accel_slow[] = {
+  { 0, 1 }, { 15, 2 }, { 40, 3 }, { 80, 5 }, { 0, 0 }
+};
+static const struct accel_point accel_fast[] = {
+  { 0, 1 }, { 10, 2 }, { 25, 4 }, { 50, 8 }, { 100, 16 }, { 0, 0 }
+};
+
+static const struct accel_point *const curves[ACCEL_CURVES] = {
+  [ACCEL_NONE] = accel_none,
+  [ACCEL_SLOW] = accel_slow,
+  [ACCEL_FAST] = accel_fast,
+};
+
+/* Initialize edit map */
+void
+editmap_init(struct editmap *editmap)
+{
+  memset(editmap, 0, sizeof(*editmap));
+}
+
+/* Get multiplier for increments at given rate (increments/s) */
+static int
+accel_mult(enum accel_curve curve, int rate)
+{
+  const struct accel_point *point = curves[curve];
+  int mult = 1;
+
+  for (; point->mult; point++)
+    if (rate >= point->rate)
+      mult = point->mult;
+
+  return mult;
+}
+
+/* Apply relative change to control */
+int
+editmap_update(struct editmap *editmap, int cc, int delta,
+               enum accel_curve curve, int max, int step, uint64_t now)
+{
+  int magnitude = delta < 0 ? -delta : delta;
+  uint64_t elapsed = now - editmap->last[cc];
+  int rate = 0;
+  int value;
+
+  if (elapsed < ACCEL_IDLE_US)
+    rate = magnitude * 1000000 / (elapsed > 1000 ? elapsed : 1000);
+  editmap->last[cc] = now;
+
+  value = editmap->value[cc] + delta * step * accel_mult(curve, rate);
+  if (value < 0) value = 0;
+  if (value > max) value = max;
+  editmap->value[cc] = value;
+
+  return value;
+}
+
+/* Get current value of control */
+int
+editmap_get(const struct editmap *editmap, int cc)
+{
+  return editmap->value[cc];
+}
+
+/* Set current value of control */
+void
+editmap_set(struct editmap *editmap, int cc, int value)
+{
+  editmap->value[cc] = value;
+}
+
+/************************** End of file editmap.c **************************/
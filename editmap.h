@@ -0,0 +1,70 @@
+/****************************************************************************
+ *
+ * editmap.h - conversion of relative incrementor values to absolute values
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _EDITMAP_H_
+#define _EDITMAP_H_
+
+#include <stdint.h>
+
+#include "midi.h"
+
+/* Number of entries in edit map, one per CC from Nocturn */
+#define EDITMAP_SIZE 128
+
+/* Max values for 7 and 14 bit controls */
+#define EDITMAP_MAX7 127
+#define EDITMAP_MAX14 MIDI_2BYTE(127, 127)
+
+/* Acceleration curves, i.e. how much faster the value changes the faster
+ * the incrementor is turned. */
+enum accel_curve
+{
+  ACCEL_NONE, /* one step per increment, regardless of speed */
+  ACCEL_SLOW, /* moderate acceleration */
+  ACCEL_FAST, /* aggressive acceleration */
+  ACCEL_CURVES
+};
+
+/* Edit map: the current absolute value of each control */
+struct editmap
+{
+  int32_t value[EDITMAP_SIZE]; /* same layout as in bank files */
+  uint64_t last[EDITMAP_SIZE]; /* time of last change, us */
+};
+
+/* Initialize edit map, setting all values to 0 */
+void editmap_init(struct editmap *editmap);
+
+/* Apply relative change delta (in increments, as sent by Nocturn) at time
+ * now (us) to control cc, limiting the result to 0..max, with each increment
+ * being step units before acceleration. Return the new value. */
+int editmap_update(struct editmap *editmap, int cc, int delta,
+                   enum accel_curve curve, int max, int step, uint64_t now);
+
+/* Get current value of control cc */
+int editmap_get(const struct editmap *editmap, int cc);
+
+/* Set current value of control cc, e.g. when receiving it from the host */
+void editmap_set(struct editmap *editmap, int cc, int value);
+
+#endif /* _EDITMAP_H_ */
+
+/************************** End of file editmap.h **************************/
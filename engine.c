@@ -0,0 +1,256 @@
+/****************************************************************************
+ *
+ * engine.c - epoll based event engine
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "engine.h"
+#include "debug.h"
+
+/* Max number of events fetched per epoll_wait() call */
+#define ENGINE_EVENTS 16
+
+/* Registered fd */
+struct engine_source {
+  int fd;
+  engine_handler handler; /* NULL once source has been deleted */
+  void *data;
+  struct engine_source *next;
+};
+
+/* Timer, implemented as a timerfd registered as a source */
+struct engine_timer {
+  int fd;
+  engine_timer_handler handler;
+  void *data;
+};
+
+static int epfd = -1;
+
+/* All registered sources */
+static struct engine_source *sources;
+
+/* Sources deleted during dispatch. These can't be freed until all events
+ * from the current epoll_wait() call have been dispatched, as the event
+ * array may still refer to them. */
+static struct engine_source *deleted;
+
+/* Time last epoll_wait() returned */
+static uint64_t woke;
+
+/* Current monotonic time, us */
+uint64_t
+engine_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Time we last woke up */
+uint64_t
+engine_wakeup_time(void)
+{
+  return woke;
+}
+
+/* Initialize event engine. */
+int
+engine_init(void)
+{
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    errprintf("Couldn't create epoll fd: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Register fd with engine. */
+int
+engine_add_fd(int fd, uint32_t events, engine_handler handler, void *data)
+{
+  struct epoll_event ev;
+  struct engine_source *source;
+
+  source = (struct engine_source *) malloc(sizeof(struct engine_source));
+  if (!source)
+    return -1;
+  source->fd = fd;
+  source->handler = handler;
+  source->data = data;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = source;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    errprintf("Couldn't add fd %d to epoll set: %s\n", fd, strerror(errno));
+    free(source);
+    return -1;
+  }
+
+  source->next = sources;
+  sources = source;
+
+  return 0;
+}
+
+/* Unregister fd. */
+int
+engine_del_fd(int fd)
+{
+  struct engine_source **sourcep;
+
+  for (sourcep = &sources; *sourcep; sourcep = &(*sourcep)->next)
+    if ((*sourcep)->fd == fd) {
+      struct engine_source *source = *sourcep;
+
+      *sourcep = source->next;
+      source->handler = NULL;
+      source->next = deleted;
+      deleted = source;
+      /* The fd may already have been closed, in which case the kernel
+       * has removed it from the epoll set already. */
+      epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+      return 0;
+    }
+
+  return -1;
+}
+
+/* Called when timerfd expires. */
+static void
+timer_expired(int fd, uint32_t events, void *data)
+{
+  struct engine_timer *timer = data;
+  uint64_t expirations;
+
+  /* Reading resets the timerfd, so that it can trigger again */
+  if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return;
+
+  timer->handler(timer->data);
+}
+
+/* Create a timer. */
+struct engine_timer *
+engine_timer_new(engine_timer_handler handler, void *data)
+{
+  struct engine_timer *timer;
+
+  timer = (struct engine_timer *) malloc(sizeof(struct engine_timer));
+  if (!timer)
+    return NULL;
+  timer->handler = handler;
+  timer->data = data;
+  timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer->fd < 0) {
+    errprintf("Couldn't create timer: %s\n", strerror(errno));
+    free(timer);
+    return NULL;
+  }
+  if (engine_add_fd(timer->fd, EPOLLIN | EPOLLET, timer_expired, timer) < 0) {
+    close(timer->fd);
+    free(timer);
+    return NULL;
+  }
+
+  return timer;
+}
+
+/* Convert microseconds to timespec */
+static void
+us_to_timespec(long us, struct timespec *ts)
+{
+  ts->tv_sec = us / 1000000;
+  ts->tv_nsec = (us % 1000000) * 1000;
+}
+
+/* Start timer. */
+int
+engine_timer_start(struct engine_timer *timer, long first_us, long interval_us)
+{
+  struct itimerspec its;
+
+  /* An all-zero it_value would disarm the timer, so expire asap instead */
+  if (first_us <= 0)
+    first_us = 1;
+  us_to_timespec(first_us, &its.it_value);
+  us_to_timespec(interval_us, &its.it_interval);
+
+  return timerfd_settime(timer->fd, 0, &its, NULL);
+}
+
+/* Stop timer. */
+int
+engine_timer_stop(struct engine_timer *timer)
+{
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+
+  return timerfd_settime(timer->fd, 0, &its, NULL);
+}
+
+/* Wait for events and dispatch them. */
+int
+engine_run_once(int timeout_ms)
+{
+  struct epoll_event events[ENGINE_EVENTS];
+  int nevents;
+  int i;
+
+  nevents = epoll_wait(epfd, events, ENGINE_EVENTS, timeout_ms);
+  woke = engine_now();
+  if (nevents < 0) {
+    if (errno == EINTR)
+      return 0;
+    errprintf("Waiting for events: %s\n", strerror(errno));
+    return -1;
+  }
+
+  for (i = 0; i < nevents; i++) {
+    struct engine_source *source = events[i].data.ptr;
+
+    if (source->handler)
+      source->handler(source->fd, events[i].events, source->data);
+  }
+
+  while (deleted) {
+    struct engine_source *source = deleted;
+
+    deleted = source->next;
+    free(source);
+  }
+
+  return nevents;
+}
+
+/************************** End of file engine.c ***************************/
@@ -0,0 +1,73 @@
+/****************************************************************************
+ *
+ * engine.h - epoll based event engine
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _ENGINE_H_
+#define _ENGINE_H_
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* Handler called when a registered fd becomes ready. events is the set of
+ * EPOLLxxx flags reported for the fd. */
+typedef void (*engine_handler)(int fd, uint32_t events, void *data);
+
+/* Handler called when a timer expires. */
+typedef void (*engine_timer_handler)(void *data);
+
+struct engine_timer;
+
+/* Current monotonic time in microseconds */
+uint64_t engine_now(void);
+
+/* engine_now() when the last engine_run_once() call stopped waiting */
+uint64_t engine_wakeup_time(void);
+
+/* Initialize event engine. Return 0 if ok, -1 on failure. */
+int engine_init(void);
+
+/* Register fd with engine. events is a set of EPOLLxxx flags, normally
+ * including EPOLLET, as all handlers are expected to consume everything
+ * that is available on the fd before returning. */
+int engine_add_fd(int fd, uint32_t events, engine_handler handler, void *data);
+
+/* Unregister fd. May be called from within a handler. */
+int engine_del_fd(int fd);
+
+/* Create a timer, initially stopped. */
+struct engine_timer *engine_timer_new(engine_timer_handler handler,
+                                      void *data);
+
+/* Start timer, expiring after first_us microseconds, and then every
+ * interval_us microseconds (or only once if interval_us is 0). */
+int engine_timer_start(struct engine_timer *timer, long first_us,
+                       long interval_us);
+
+/* Stop timer. */
+int engine_timer_stop(struct engine_timer *timer);
+
+/* Wait at most timeout_ms ms (-1 = indefinitely) for events, and dispatch
+ * all events received to their respective handlers.
+ * Return number of events dispatched, or -1 on error. */
+int engine_run_once(int timeout_ms);
+
+#endif /* _ENGINE_H_ */
+
+/************************** End of file engine.h ***************************/
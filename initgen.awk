@@ -0,0 +1,85 @@
+#
+# initgen.awk - generate start-up byte arrays from nocturn.init
+#
+# Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# Usage: awk -f initgen.awk nocturn.init > init_table.c
+
+function fail(msg)
+{
+  printf("%s:%d: %s\n", FILENAME, FNR, msg) > "/dev/stderr"
+  failed = 1
+  exit 1
+}
+
+# Convert decimal or 0x<hex> number 0..127, failing if it isn't one
+function number(s,    v, i)
+{
+  if (s ~ /^[0-9]+$/)
+    v = s + 0
+  else if (s ~ /^0[xX][0-9a-fA-F]+$/) {
+    v = 0
+    for (i = 3; i <= length(s); i++)
+      v = v * 16 + index("0123456789abcdef", tolower(substr(s, i, 1))) - 1
+  } else
+    fail("bad number " s)
+  if (v > 127)
+    fail(s " is out of range 0..127")
+  return v
+}
+
+# Format byte array of n entries, 8 per line
+function array(a, n,    s, i)
+{
+  if (!n)
+    return "  0 /* empty */\n"
+  s = ""
+  for (i = 0; i < n; i++)
+    s = s sprintf("%s0x%02x,%s", (i % 8) ? " " : "  ", a[i],
+                  (i % 8 == 7 || i == n - 1) ? "\n" : "")
+  return s
+}
+
+/^[ \t]*(#|$)/ { next }
+
+{
+  sub(/[ \t]*#.*/, "")
+  if (NF != 3)
+    fail("expected send|led <cc> <value>")
+  cc = number($2)
+  value = number($3)
+  if ($1 == "send") {
+    script[nscript++] = cc
+    script[nscript++] = value
+  } else if ($1 == "led") {
+    leds[nleds++] = cc
+    leds[nleds++] = value
+  } else
+    fail("unknown command " $1)
+}
+
+END {
+  if (failed)
+    exit 1
+  print "/* Generated from " FILENAME " by initgen.awk. Do not edit. */"
+  print ""
+  print "#include \"tx.h\""
+  print "#include \"leds.h\""
+  print ""
+  print "/* CC/value pairs sent to Nocturn when connected */"
+  print "const uint8_t init_script[] = {"
+  printf("%s", array(script, nscript))
+  print "};"
+  print "const int init_script_len = " nscript + 0 ";"
+  print ""
+  print "/* CC/value pairs of initial LED state */"
+  print "const uint8_t init_leds[] = {"
+  printf("%s", array(leds, nleds))
+  print "};"
+  print "const int init_leds_len = " nleds + 0 ";"
+}
@@ -0,0 +1,128 @@
+/****************************************************************************
+ *
+ * leds.c - LED state of Nocturn
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include <string.h>
+
+#include "leds.h"
+
+#define DIRTY_WORD(cc) ((cc) >> 5)
+#define DIRTY_BIT(cc) (1u << ((cc) & 31))
+
+/* Initialize LED state */
+void
+leds_init(struct leds *leds)
+{
+  memset(leds, 0, sizeof(*leds));
+}
+
+/* Get LED CC for control */
+int
+leds_cc(int control)
+{
+  if (control >= 64 && control <= 71) /* incrementors */
+    return control;
+  if (control == 74) /* speed dial */
+    return 80;
+  if (control >= 112 && control <= 127) /* buttons */
+    return control;
+  return -1;
+}
+
+/* Get LED ring mode CC for control */
+int
+leds_mode_cc(int control)
+{
+  if (control >= 64 && control <= 71) /* incrementors */
+    return control + 8;
+  if (control == 74) /* speed dial */
+    return 81;
+  return -1;
+}
+
+/* Set LED value */
+int
+leds_set(struct leds *leds, int cc, int value)
+{
+  int word = DIRTY_WORD(cc);
+  uint32_t bit = DIRTY_BIT(cc);
+  int was_dirty = leds->dirty[word] & bit;
+
+  leds->value[cc] = value;
+  leds->known[word] |= bit;
+  if ((leds->valid[word] & bit) && leds->shown[cc] == value) {
+    /* Back to what is displayed; cancel any pending update */
+    leds->dirty[word] &= ~bit;
+    return 0;
+  }
+  leds->dirty[word] |= bit;
+
+  return !was_dirty;
+}
+
+/* Mark all known LEDs as dirty */
+void
+leds_replay(struct leds *leds)
+{
+  int i;
+
+  for (i = 0; i < LEDS / 32; i++) {
+    leds->valid[i] = 0;
+    leds->dirty[i] = leds->known[i];
+  }
+}
+
+/* Check if any LED is dirty */
+int
+leds_dirty(const struct leds *leds)
+{
+  int i;
+
+  for (i = 0; i < LEDS / 32; i++)
+    if (leds->dirty[i])
+      return 1;
+
+  return 0;
+}
+
+/* Send all dirty LEDs */
+int
+leds_flush(struct leds *leds, leds_sender sender, void *data)
+{
+  int sent = 0;
+  int i;
+
+  for (i = 0; i < LEDS / 32; i++)
+    while (leds->dirty[i]) {
+      int bit = __builtin_ctz(leds->dirty[i]);
+      int cc = i * 32 + bit;
+
+      if (sender(cc, leds->value[cc], data) < 0)
+        return -1;
+      leds->shown[cc] = leds->value[cc];
+      leds->valid[i] |= 1u << bit;
+      leds->dirty[i] &= ~(1u << bit);
+      sent++;
+    }
+
+  return sent;
+}
+
+/*************************** End of file leds.c ****************************/
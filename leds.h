@@ -0,0 +1,87 @@
+/****************************************************************************
+ *
+ * leds.h - LED state of Nocturn
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _LEDS_H_
+#define _LEDS_H_
+
+#include <stdint.h>
+
+/* Number of CC's to Nocturn */
+#define LEDS 128
+
+/* LED update frame interval. Updates within one frame are coalesced into
+ * a single write per LED. */
+#define LED_FRAME_US 20000
+
+/* Shadow of LED state of Nocturn. LEDs are set using the CC's described at
+ * the top of nocturn.c: CC64..71 incrementor LED ring values, CC72..79 their
+ * LED ring modes, CC80 speed dial LED ring value, CC81 its mode, and
+ * CC112..127 button LEDs.
+ * For each CC we keep the value we want the Nocturn to display, and the
+ * value it is currently displaying, as far as we know. Only CC's where
+ * these differ are sent to the Nocturn. */
+struct leds
+{
+  uint8_t value[LEDS];       /* wanted value */
+  uint8_t shown[LEDS];       /* value last sent to Nocturn */
+  uint32_t known[LEDS / 32]; /* bit set = value has been set */
+  uint32_t valid[LEDS / 32]; /* bit set = shown is valid */
+  uint32_t dirty[LEDS / 32]; /* bit set = value needs to be sent */
+};
+
+/* LED sender, called by leds_flush() for each LED to be sent. Return < 0
+ * on failure, in which case the LED is left dirty. */
+typedef int (*leds_sender)(int cc, int value, void *data);
+
+/* Initialize LED state */
+void leds_init(struct leds *leds);
+
+/* Get LED CC for control CC from Nocturn, or -1 if it has no LED. */
+int leds_cc(int control);
+
+/* Get LED ring mode CC for control CC from Nocturn, or -1 if none. */
+int leds_mode_cc(int control);
+
+/* Set LED value. Return 1 if this made the LED dirty, i.e. the value
+ * differs from what the Nocturn displays and no update was already
+ * pending for it. */
+int leds_set(struct leds *leds, int cc, int value);
+
+/* Mark all LED's that have been set as dirty, and forget what the Nocturn
+ * displays, e.g. after it has been reconnected. The next leds_flush() then
+ * sends the complete LED state. */
+void leds_replay(struct leds *leds);
+
+/* Return non-zero if any LED needs to be sent */
+int leds_dirty(const struct leds *leds);
+
+/* Send all dirty LEDs using sender. Return number of LEDs sent, or < 0 if
+ * sender failed. */
+int leds_flush(struct leds *leds, leds_sender sender, void *data);
+
+/* Initial LED state, as CC/value pairs. Generated at build time from
+ * nocturn.init by initgen.awk. */
+extern const uint8_t init_leds[];
+extern const int init_leds_len;
+
+#endif /* _LEDS_H_ */
+
+/*************************** End of file leds.h ****************************/
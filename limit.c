@@ -0,0 +1,208 @@
+/****************************************************************************
+ *
+ * limit.c - MIDI output rate limiting
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include <string.h>
+
+#include "limit.h"
+#include "metrics.h"
+
+/* Budget needed for sending one CC */
+#define UNIT 1000000
+
+/* Max budget, i.e. how many CC's may be sent in one go after being idle,
+ * as a fraction of the rate, so that a brief burst isn't held back.
+ * At least 2 CC's, so that a 14 bit pair can always be sent together. */
+#define BURST_DIV 10
+#define BURST_MIN 2
+
+/* Limit for sum of held back relative increments */
+#define SUM_MAX 8191
+
+/* Initialize limiter */
+void
+limit_init(struct limiter *limit, int rate)
+{
+  int burst = rate / BURST_DIV > BURST_MIN ? rate / BURST_DIV : BURST_MIN;
+
+  memset(limit, 0, sizeof(*limit));
+  limit->rate = rate;
+  limit->burst = (int64_t)burst * UNIT;
+  limit->budget = limit->burst;
+}
+
+/* Add to budget for the time passed since it was last updated */
+static void
+refill(struct limiter *limit, uint64_t now)
+{
+  if (now <= limit->last)
+    return;
+  if (now - limit->last >= (uint64_t)limit->burst / limit->rate)
+    limit->budget = limit->burst;
+  else {
+    limit->budget += (int64_t)(now - limit->last) * limit->rate;
+    if (limit->budget > limit->burst)
+      limit->budget = limit->burst;
+  }
+  limit->last = now;
+}
+
+static int
+is_pending(const struct limiter *limit, int key)
+{
+  return limit->pending[key / 32] & (1u << (key % 32));
+}
+
+/* Hold back CC, coalescing it with one already held back */
+static void
+hold(struct limiter *limit, const struct midi_cc *cc, int relative)
+{
+  int key = (cc->channel - 1) * 128 + cc->controller;
+  uint32_t bit = 1u << (key % 32);
+  int sum;
+
+  if (is_pending(limit, key))
+    metrics_add(METRIC_MIDI_COALESCED, 1);
+  else {
+    limit->pending[key / 32] |= bit;
+    limit->npending++;
+    limit->value[key] = 0;
+  }
+
+  if (!relative) {
+    limit->relative[key / 32] &= ~bit;
+    limit->value[key] = cc->value;
+    return;
+  }
+
+  limit->relative[key / 32] |= bit;
+  sum = limit->value[key] + (cc->value < 64 ? cc->value : cc->value - 128);
+  if (sum > SUM_MAX)
+    sum = SUM_MAX;
+  else if (sum < -SUM_MAX)
+    sum = -SUM_MAX;
+  limit->value[key] = sum;
+}
+
+/* Offer CC's for sending */
+int
+limit_put(struct limiter *limit, const struct midi_cc *ccs, int n,
+          int relative, uint64_t now)
+{
+  int i;
+
+  if (!limit->rate)
+    return n;
+
+  /* Anything already held back goes first */
+  refill(limit, now);
+  if (!limit->npending && limit->budget > 0) {
+    limit->budget -= (int64_t)n * UNIT;
+    return n;
+  }
+
+  for (i = 0; i < n; i++)
+    hold(limit, &ccs[i], relative);
+
+  return 0;
+}
+
+/* Fill in CC held back as key. Return number of CC's filled in: relative
+ * increments that have summed to 0 aren't sent at all. Increments that
+ * don't fit in one CC are left for the next time. */
+static int
+release(struct limiter *limit, int key, struct midi_cc *out)
+{
+  uint32_t bit = 1u << (key % 32);
+  int delta;
+
+  limit->pending[key / 32] &= ~bit;
+  limit->npending--;
+
+  out->channel = key / 128 + 1;
+  out->controller = key % 128;
+  if (!(limit->relative[key / 32] & bit))
+    out->value = limit->value[key];
+  else {
+    delta = limit->value[key];
+    if (!delta)
+      return 0;
+    if (delta > 63)
+      delta = 63;
+    else if (delta < -63)
+      delta = -63;
+    limit->value[key] -= delta;
+    if (limit->value[key]) {
+      limit->pending[key / 32] |= bit;
+      limit->npending++;
+    }
+    out->value = delta < 0 ? delta + 128 : delta;
+  }
+
+  limit->budget -= UNIT;
+  return 1;
+}
+
+/* Send what the budget allows. Controllers are visited round robin, so that
+ * a control that's moved all the time doesn't starve the others. */
+int
+limit_take(struct limiter *limit, uint64_t now, struct midi_cc *out,
+           int max)
+{
+  int n = 0;
+  int i;
+
+  if (!limit->npending)
+    return 0;
+
+  refill(limit, now);
+  for (i = 0; i < LIMIT_KEYS && limit->npending && limit->budget > 0 &&
+              n + 2 <= max; i++) {
+    int key = (limit->next + i) % LIMIT_KEYS;
+    int controller = key % 128;
+
+    if (!is_pending(limit, key))
+      continue;
+
+    /* The LSB of a 14 bit pair is sent together with its MSB */
+    if (controller >= 32 && controller < 64 && is_pending(limit, key - 32))
+      continue;
+    n += release(limit, key, &out[n]);
+    if (controller < 32 && is_pending(limit, key + 32))
+      n += release(limit, key + 32, &out[n]);
+  }
+  limit->next = (limit->next + i) % LIMIT_KEYS;
+
+  return n;
+}
+
+/* Time when budget allows sending again */
+uint64_t
+limit_deadline(const struct limiter *limit)
+{
+  if (!limit->npending)
+    return 0;
+  if (limit->budget > 0)
+    return limit->last;
+
+  return limit->last + (limit->rate - limit->budget) / limit->rate;
+}
+
+/*************************** End of file limit.c ***************************/
@@ -0,0 +1,71 @@
+/****************************************************************************
+ *
+ * limit.h - MIDI output rate limiting
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _LIMIT_H_
+#define _LIMIT_H_
+
+#include <stdint.h>
+
+#include "midi.h"
+
+/* Number of distinct CC's on a port: 16 channels of 128 controllers */
+#define LIMIT_KEYS (16 * 128)
+
+/* Rate limiter for the MIDI output of one port.
+ * CC's are passed on as long as the budget allows. Once it is used up,
+ * further CC's are held back until the budget has been refilled, and
+ * coalesced per channel and controller in the meantime: for absolute values
+ * only the latest value is kept, whereas relative increments are summed so
+ * that no movement is lost. */
+struct limiter
+{
+  int rate;                         /* CC's per second, 0 = no limit */
+  int64_t budget;                   /* millionths of CC's that may be sent */
+  int64_t burst;                    /* max budget, same unit */
+  uint64_t last;                    /* time budget was last updated, us */
+  int npending;                     /* number of CC's held back */
+  int next;                         /* where to continue sending from */
+  uint32_t pending[LIMIT_KEYS / 32];
+  uint32_t relative[LIMIT_KEYS / 32];
+  int16_t value[LIMIT_KEYS];        /* latest value, or sum of increments */
+};
+
+/* Initialize limiter, for at most rate CC's per second (0 = no limit) */
+void limit_init(struct limiter *limit, int rate);
+
+/* Offer group of n CC's generated together at time now (us), relative
+ * signifying relative increments. Return n if they can be sent right away,
+ * or 0 if they have been held back. A group (e.g. a 14 bit MSB/LSB pair) is
+ * always either sent or held back as a whole. */
+int limit_put(struct limiter *limit, const struct midi_cc *ccs, int n,
+              int relative, uint64_t now);
+
+/* Fill in out[] with at most max CC's held back that the budget allows to
+ * be sent at time now (us). Return the number filled in. */
+int limit_take(struct limiter *limit, uint64_t now, struct midi_cc *out,
+               int max);
+
+/* Return time (us) when more held back CC's can be sent, or 0 if none */
+uint64_t limit_deadline(const struct limiter *limit);
+
+#endif /* _LIMIT_H_ */
+
+/************************** End of file limit.h ****************************/
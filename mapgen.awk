@@ -0,0 +1,176 @@
+#
+# mapgen.awk - generate CC dispatch table from nocturn.map
+#
+# Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# Usage: awk -f mapgen.awk nocturn.map > map_table.c
+
+function fail(msg)
+{
+  printf("%s:%d: %s\n", FILENAME, FNR, msg) > "/dev/stderr"
+  failed = 1
+  exit 1
+}
+
+# Whether output o is set in bit mask
+function has_output(mask, o)
+{
+  return int(mask / 2 ^ o) % 2
+}
+
+BEGIN {
+  types["none"] = "CTL_NONE"
+  types["relative"] = "CTL_RELATIVE"
+  types["absolute"] = "CTL_ABSOLUTE"
+  types["momentary"] = "CTL_MOMENTARY"
+  types["toggle"] = "CTL_TOGGLE"
+  types["touch"] = "CTL_TOUCH"
+  types["encoder"] = "CTL_ENCODER"
+  types["bank"] = "CTL_BANK"
+  accels["none"] = "ACCEL_NONE"
+  accels["slow"] = "ACCEL_SLOW"
+  accels["fast"] = "ACCEL_FAST"
+  for (cc = 0; cc < 128; cc++)
+    entry[cc] = "{ CTL_NONE, 0, 0, 0, ACCEL_NONE, 0, 0, 0 }"
+  # Output 0 is the Nocturn's own port
+  noutputs = 1
+  outputs["nocturn"] = 0
+  oname[0] = "nocturn"
+  ochannel[0] = 0
+  oconnect[0] = ""
+}
+
+/^[ \t]*(#|$)/ { next }
+
+$1 == "output" {
+  if (NF < 2)
+    fail("expected output <name> [channel=<channel>] [connect=<address>]")
+  if ($2 !~ /^[A-Za-z0-9_-]+$/)
+    fail("bad output name " $2)
+  if ($2 in outputs)
+    fail("output " $2 " already defined")
+  if (noutputs == 8)
+    fail("too many outputs, max 7 besides nocturn")
+  o = noutputs++
+  outputs[$2] = o
+  oname[o] = $2
+  ochannel[o] = 0
+  oconnect[o] = ""
+  for (i = 3; i <= NF; i++) {
+    split($i, opt, "=")
+    if (opt[1] == "channel") {
+      ochannel[o] = opt[2] + 0
+      if (opt[2] !~ /^[0-9]+$/ || ochannel[o] < 1 || ochannel[o] > 16)
+        fail("bad MIDI channel " opt[2])
+    } else if (opt[1] == "connect") {
+      oconnect[o] = substr($i, 9)
+      if (oconnect[o] !~ /^[^"\\]+$/)
+        fail("bad ALSA address " oconnect[o])
+    } else
+      fail("unknown output option " opt[1])
+  }
+  next
+}
+
+{
+  if (NF < 3)
+    fail("expected <cc>[-<last cc>] <type> <channel> [<output cc>] [<option>=<value> ...]")
+  n = split($1, range, "-")
+  first = range[1] + 0
+  last = (n > 1) ? range[2] + 0 : first
+  if (n > 2 || first < 0 || last > 127 || first > last)
+    fail("bad CC range " $1)
+  if (!($2 in types))
+    fail("unknown control type " $2)
+  channel = $3 + 0
+  if (channel < 1 || channel > 16)
+    fail("bad MIDI channel " $3)
+  out = first
+  bits14 = 0
+  nrpn = -1
+  accel = "ACCEL_NONE"
+  debounce = 0
+  mask = 1
+  for (i = 4; i <= NF; i++) {
+    if (split($i, opt, "=") == 1) {
+      if (i > 4)
+        fail("output CC must precede options")
+      out = $i + 0
+    } else if (opt[1] == "accel") {
+      if (!(opt[2] in accels))
+        fail("unknown acceleration curve " opt[2])
+      accel = accels[opt[2]]
+    } else if (opt[1] == "bits") {
+      if (opt[2] == 14)
+        bits14 = 1
+      else if (opt[2] != 7)
+        fail("bits must be 7 or 14")
+    } else if (opt[1] == "nrpn") {
+      if ($2 != "encoder")
+        fail("nrpn only applies to encoders")
+      nrpn = opt[2] + 0
+      if (opt[2] !~ /^[0-9]+$/ || nrpn + last - first > 16383)
+        fail("nrpn must be 0..16383")
+    } else if (opt[1] == "debounce") {
+      if ($2 != "momentary" && $2 != "toggle" && $2 != "touch")
+        fail("debounce only applies to buttons and touch")
+      debounce = opt[2] + 0
+      if (opt[2] !~ /^[0-9]+$/ || debounce > 255)
+        fail("debounce must be 0..255 ms")
+    } else if (opt[1] == "to") {
+      mask = 0
+      n = split(opt[2], names, ",")
+      for (j = 1; j <= n; j++) {
+        if (!(names[j] in outputs))
+          fail("unknown output " names[j])
+        if (!has_output(mask, outputs[names[j]]))
+          mask += 2 ^ outputs[names[j]]
+      }
+    } else
+      fail("unknown option " opt[1])
+  }
+  if (out < 0 || out + last - first > 127)
+    fail("bad output CC " out)
+  if (bits14 && nrpn < 0 && out + last - first > 31)
+    fail("14 bit output needs CC's in range 0..31")
+  if (bits14 && nrpn >= 0)
+    flags = "MAP_14BIT | MAP_NRPN"
+  else if (bits14)
+    flags = "MAP_14BIT"
+  else if (nrpn >= 0)
+    flags = "MAP_NRPN"
+  else
+    flags = "0"
+  for (cc = first; cc <= last; cc++)
+    entry[cc] = sprintf("{ %s, %d, %d, %s, %s, %d, %d, 0x%02x }", types[$2],
+                        channel, out + cc - first, flags, accel, debounce,
+                        nrpn < 0 ? 0 : nrpn + cc - first, mask)
+}
+
+END {
+  if (failed)
+    exit 1
+  print "/* Generated from " FILENAME " by mapgen.awk. Do not edit. */"
+  print ""
+  print "#include <stddef.h>"
+  print ""
+  print "#include \"router.h\""
+  print ""
+  print "const struct control_map control_map[CONTROLS] = {"
+  for (cc = 0; cc < 128; cc++)
+    printf("  /* %3d */ %s,\n", cc, entry[cc])
+  print "};"
+  print ""
+  print "const struct router_output router_outputs[] = {"
+  for (o = 0; o < noutputs; o++)
+    printf("  { \"%s\", %d, %s },\n", oname[o], ochannel[o],
+           oconnect[o] == "" ? "NULL" : "\"" oconnect[o] "\"")
+  print "};"
+  print ""
+  print "const int router_noutputs = " noutputs ";"
+}
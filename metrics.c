@@ -0,0 +1,207 @@
+/****************************************************************************
+ *
+ * metrics.c - operational counters and metrics endpoint
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#define _GNU_SOURCE /* for accept4() */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "engine.h"
+#include "debug.h"
+
+/* Max size of exported text */
+#define METRICS_BUFSIZE 4096
+
+uint64_t metrics[METRICS];
+
+/* How each metric is exported. Consecutive entries with the same name
+ * form one metric family, distinguished by their labels. */
+static const struct metric_info {
+  const char *name;
+  const char *labels;
+  const char *type;
+  const char *help;
+} metric_info[METRICS] = {
+  [METRIC_RX_COMPLETED] = { "nocturn_rx_transfers_total",
+                            "status=\"completed\"", "counter",
+                            "USB receive transfers finished, by status" },
+  [METRIC_RX_TIMED_OUT] = { "nocturn_rx_transfers_total",
+                            "status=\"timed_out\"" },
+  [METRIC_RX_CANCELLED] = { "nocturn_rx_transfers_total",
+                            "status=\"cancelled\"" },
+  [METRIC_RX_NO_DEVICE] = { "nocturn_rx_transfers_total",
+                            "status=\"no_device\"" },
+  [METRIC_RX_ERROR] = { "nocturn_rx_transfers_total",
+                        "status=\"error\"" },
+  [METRIC_RX_BYTES] = { "nocturn_rx_bytes_total", NULL, "counter",
+                        "Bytes received from Nocturns" },
+  [METRIC_EVENTS] = { "nocturn_events_total", NULL, "counter",
+                      "Events received from Nocturns" },
+  [METRIC_EVENTS_IGNORED] = { "nocturn_events_ignored_total", NULL,
+                              "counter",
+                              "Events for controls that aren't mapped" },
+  [METRIC_EVENTS_DROPPED] = { "nocturn_events_dropped_total", NULL,
+                              "counter",
+                              "Events lost because the event ring was full" },
+  [METRIC_EVENTS_DEBOUNCED] = { "nocturn_events_debounced_total", NULL,
+                                "counter",
+                                "Control changes reverted within the "
+                                "debounce time" },
+  [METRIC_MIDI_OUT] = { "nocturn_midi_out_total", NULL, "counter",
+                        "MIDI CC's sent to ALSA" },
+  [METRIC_MIDI_COALESCED] = { "nocturn_midi_coalesced_total", NULL,
+                              "counter",
+                              "MIDI CC's merged with a later one because "
+                              "of the rate limit" },
+  [METRIC_MIDI_ERRORS] = { "nocturn_midi_errors_total", NULL, "counter",
+                           "Failures sending MIDI to ALSA" },
+  [METRIC_RECONNECTS] = { "nocturn_reconnects_total", NULL, "counter",
+                          "Nocturns connected again after being lost" },
+  [METRIC_DEVICES] = { "nocturn_devices", NULL, "gauge",
+                       "Nocturns currently connected" },
+  [METRIC_TX_PENDING] = { "nocturn_tx_pending", NULL, "gauge",
+                          "CC's waiting to be sent to Nocturns" },
+};
+
+static int listen_fd = -1;
+static struct sockaddr_un addr;
+static metrics_update update_hook;
+
+/* Format all metrics into buf. Return length. */
+int
+metrics_format(char *buf, int size)
+{
+  const char *family = NULL;
+  int len = 0;
+  int i;
+
+  for (i = 0; i < METRICS && len < size; i++) {
+    const struct metric_info *info = &metric_info[i];
+    uint64_t value = __atomic_load_n(&metrics[i], __ATOMIC_RELAXED);
+
+    if (!family || strcmp(family, info->name)) {
+      family = info->name;
+      len += snprintf(buf + len, size - len, "# HELP %s %s\n# TYPE %s %s\n",
+                      info->name, info->help, info->name, info->type);
+      if (len >= size)
+        break;
+    }
+    if (info->labels)
+      len += snprintf(buf + len, size - len, "%s{%s} %llu\n", info->name,
+                      info->labels, (unsigned long long)value);
+    else
+      len += snprintf(buf + len, size - len, "%s %llu\n", info->name,
+                      (unsigned long long)value);
+  }
+
+  return len < size ? len : size - 1;
+}
+
+/* Send metrics to client. We never wait for the client: if it doesn't
+ * have room for everything at once, it gets what fits. */
+static void
+metrics_serve(int fd)
+{
+  static const char header[] = "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "\r\n";
+  char buf[METRICS_BUFSIZE];
+  int len;
+
+  /* Consume request, if any, so closing doesn't reset the connection */
+  while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+    ;
+
+  if (update_hook)
+    update_hook();
+  len = snprintf(buf, sizeof(buf), "%s", header);
+  len += metrics_format(buf + len, sizeof(buf) - len);
+  if (send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    dbgprintf("Sending metrics: %s\n", strerror(errno));
+  shutdown(fd, SHUT_WR);
+  close(fd);
+}
+
+/* Called by engine when there are clients waiting */
+static void
+metrics_accept(int fd, uint32_t events, void *data)
+{
+  int client;
+
+  while ((client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    metrics_serve(client);
+  if (errno != EAGAIN && errno != EWOULDBLOCK)
+    errprintf("Accepting metrics connection: %s\n", strerror(errno));
+}
+
+/* Set up metrics socket */
+int
+metrics_init(const char *path, metrics_update update)
+{
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errprintf("Metrics socket path too long: %s\n", path);
+    return -1;
+  }
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    errprintf("Couldn't create metrics socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path); /* left over from last time */
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, 8) < 0) {
+    errprintf("Couldn't listen on %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+  if (engine_add_fd(listen_fd, EPOLLIN | EPOLLET, metrics_accept, NULL) < 0)
+    goto fail;
+
+  update_hook = update;
+  return 0;
+
+fail:
+  close(listen_fd);
+  listen_fd = -1;
+  return -1;
+}
+
+/* Remove metrics socket */
+void
+metrics_exit(void)
+{
+  if (listen_fd < 0)
+    return;
+  engine_del_fd(listen_fd);
+  close(listen_fd);
+  unlink(addr.sun_path);
+  listen_fd = -1;
+}
+
+/************************** End of file metrics.c ***************************/
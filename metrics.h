@@ -0,0 +1,82 @@
+/****************************************************************************
+ *
+ * metrics.h - operational counters and metrics endpoint
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+/* Counters and gauges. Counters only ever go up, gauges are set to the
+ * current value of something by the update hook before being exported. */
+enum metric {
+  METRIC_RX_COMPLETED,      /* USB receive transfers, by status */
+  METRIC_RX_TIMED_OUT,
+  METRIC_RX_CANCELLED,
+  METRIC_RX_NO_DEVICE,
+  METRIC_RX_ERROR,
+  METRIC_RX_BYTES,          /* bytes received from Nocturns and parsed */
+  METRIC_EVENTS,            /* events parsed */
+  METRIC_EVENTS_IGNORED,    /* events not mapped to anything */
+  METRIC_EVENTS_DROPPED,    /* events lost because event ring was full */
+  METRIC_EVENTS_DEBOUNCED,  /* changes reverted within debounce time */
+  METRIC_MIDI_OUT,          /* MIDI CC's queued for ALSA */
+  METRIC_MIDI_ERRORS,       /* failures to queue or send MIDI to ALSA */
+  METRIC_MIDI_COALESCED,    /* MIDI CC's merged when rate limited */
+  METRIC_RECONNECTS,        /* Nocturns connected again after being lost */
+  METRIC_DEVICES,           /* gauge: Nocturns currently connected */
+  METRIC_TX_PENDING,        /* gauge: CC's waiting in transmit queues */
+  METRICS
+};
+
+extern uint64_t metrics[METRICS];
+
+/* Add to counter. Lock-free, can be called from any thread. */
+static inline void metrics_add(enum metric m, uint64_t n)
+{
+  __atomic_add_fetch(&metrics[m], n, __ATOMIC_RELAXED);
+}
+
+/* Set gauge */
+static inline void metrics_set(enum metric m, uint64_t value)
+{
+  __atomic_store_n(&metrics[m], value, __ATOMIC_RELAXED);
+}
+
+/* Hook called before metrics are exported, to update gauges */
+typedef void (*metrics_update)(void);
+
+/* Export metrics on Unix socket path, in Prometheus text format. The
+ * metrics are written to each client as soon as it connects, prefixed by
+ * a minimal HTTP header so that both "curl --unix-socket" and plain
+ * "socat - UNIX-CONNECT:path" can be used. Requires engine_init() to have
+ * been called. Return 0 if ok, -1 if failure. */
+int metrics_init(const char *path, metrics_update update);
+
+/* Format all metrics into buf of size bytes, in Prometheus text format,
+ * without updating the gauges. Return length. */
+int metrics_format(char *buf, int size);
+
+/* Remove socket */
+void metrics_exit(void);
+
+#endif /* _METRICS_H_ */
+
+/************************** End of file metrics.h ***************************/
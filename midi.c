@@ -19,142 +19,133 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  ****************************************************************************/
 
-#include <asoundlib.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #include "midi.h"
 #include "debug.h"
-#include <alloca.h>
 
-/* ALSA related stuff */
-int seq_port;
-snd_seq_t *seq;
+/* Selected backend */
+static const struct midi_backend *backend;
+
+/* Port created by midi_init() */
+static int default_port = -1;
+
+/* Scheduled output offset */
+int midi_offset_us = 0;
 
 /* Receiver(s) */
 static midi_cc_receiver cc_receiver;
+static midi_program_receiver program_receiver;
 
-/* Initialize ALSA sequencer interface, and create MIDI port */
+/* Select backend */
+void
+midi_set_backend(const struct midi_backend *b)
+{
+  backend = b;
+}
+
+/* Initialize MIDI backend, and create MIDI port */
 /* Return list of fds that main loop needs to poll() in order to detect
  * activity. */
 /* Returned structure pointer is allocated using malloc. */
 struct polls *
-midi_init_alsa(void)
+midi_init(void)
 {
   struct polls *polls;
-  int npfd;
-  int i;
 
-  if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0) {
-    dbgprintf("Couldn't open ALSA sequencer: %s\n", snd_strerror(errno));
-    return NULL;
-  }
-  snd_seq_set_client_name(seq, "Nocturn");
-  seq_port = snd_seq_create_simple_port(seq, "Nocturn port 1",
-	 			        SND_SEQ_PORT_CAP_READ |
-				        SND_SEQ_PORT_CAP_WRITE |
-				        SND_SEQ_PORT_CAP_SUBS_READ |
-				        SND_SEQ_PORT_CAP_SUBS_WRITE,
-				        SND_SEQ_PORT_TYPE_APPLICATION);
-  if (seq_port < 0) {
-    dbgprintf("Couldn't create sequencer port: %s\n", snd_strerror(errno));
+  if (!backend) {
+    errprintf("No MIDI backend selected\n");
     return NULL;
   }
 
-  /* Fetch poll descriptor(s) for MIDI input (normally only one) */
-  npfd = snd_seq_poll_descriptors_count(seq, POLLIN);
-  polls = (struct polls *) malloc(sizeof(struct polls) +
-				  npfd * sizeof(struct pollfd));
-  polls->npfd = npfd;
-  snd_seq_poll_descriptors(seq, polls->pollfds, npfd, POLLIN);
+  polls = backend->init();
+  if (!polls)
+    return NULL;
 
-  snd_seq_nonblock(seq, SND_SEQ_NONBLOCK);
+  default_port = midi_create_port("Nocturn port 1");
+  if (default_port < 0) {
+    free(polls);
+    return NULL;
+  }
 
   return polls;
 }
 
-
-/* Set up ALSA MIDI subscription according to supplied parameter. */
-static int
-subscribe(snd_seq_port_subscribe_t *sub)
+/* Create MIDI port. Return port number, or < 0 on failure. */
+int
+midi_create_port(const char *name)
 {
-  if (snd_seq_get_port_subscription(seq, sub) == 0) {
-    dbgprintf("Connection between editor and device already established\n");
-    return 0;
-  }
-
-  if (snd_seq_subscribe_port(seq, sub) < 0) {
-    dbgprintf("Couldn't estabilsh connection between editor and device\n");
-    return -1;
-  }
+  return backend->create_port(name);
+}
 
-  return 0;
+/* Return port created by midi_init() */
+int
+midi_default_port(void)
+{
+  return default_port;
 }
 
 /* Make bidirectional MIDI connection to specified remote device */
-/* Remote device name is saved after first call (or rather the pointer to it,
- * so the actual string must not be deallocated); subsequent calls may use
- * NULL as the remote_device. */
 int
-midi_connect(const char *remote_device)
+midi_connect(int port, const char *remote_device)
 {
-  int client;
-  snd_seq_port_subscribe_t *sub;
-  snd_seq_addr_t my_addr;
-  snd_seq_addr_t remote_addr;
-  static const char *saved_remote_device = "";
-
-  if (remote_device)
-    saved_remote_device = remote_device;
-
-  client = snd_seq_client_id(seq);
-  if (client < 0) {
-    dbgprintf("Can't get client_id: %d\n", client);
-    return client;
-  }
-  dbgprintf("Client address %d:%d\n", client, seq_port);
-
-  snd_seq_port_subscribe_alloca(&sub);
-
-  /* My address */
-  my_addr.client = client;
-  my_addr.port = seq_port;
-
-  /* Other devices address */
-  if (snd_seq_parse_address(seq, &remote_addr, saved_remote_device) < 0) {
-    dbgprintf("Can't locate destination device %s\n", saved_remote_device);
+  if (!backend->connect) {
+    dbgprintf("MIDI backend %s can't connect to devices\n", backend->name);
     return -1;
   }
 
-  /* We always attempt to set up subscription in both directions, regardless
-   * of which error occurs when setting up the first direction. */
+  return backend->connect(port, remote_device);
+}
 
-  /* Set up sender and destination in subscription. */
-  snd_seq_port_subscribe_set_sender(sub, &my_addr);
-  snd_seq_port_subscribe_set_dest(sub, &remote_addr);
+/* Send control change message */
+int
+midi_send_control_change(int channel, int controller, int value)
+{
+  int ret = backend->queue_cc(default_port, channel, controller, value, 0);
+  logprintf(LOG_EVENTS, "Ch %d:CC %d:%d\n", channel, controller, value);
+  if (ret < 0)
+    return ret;
+  return backend->flush();
+}
 
-  int res = subscribe(sub);
+/* Queue control change message. It will be sent on the next midi_flush(),
+ * or earlier if the backend's output buffer fills up. */
+int
+midi_queue_control_change(int port, int channel, int controller, int value)
+{
+  int ret = backend->queue_cc(port, channel, controller, value, 0);
+  logprintf(LOG_EVENTS, "Port %d:Ch %d:CC %d:%d (queued)\n", port, channel,
+            controller, value);
+  return ret;
+}
 
-  /* And now, connection in other direction. */
-  snd_seq_port_subscribe_set_sender(sub, &remote_addr);
-  snd_seq_port_subscribe_set_dest(sub, &my_addr);
+/* Queue array of control change messages.
+ * Return number of messages queued, or negative error code if the first
+ * failing message could not be queued. */
+int
+midi_queue_control_changes(int port, const struct midi_cc *ccs, int n,
+                           uint64_t time)
+{
+  int i;
 
-  int res2 = subscribe(sub);
-  if (res == 0) res = res2; /* if first subscribe() had no error */
+  for (i = 0; i < n; i++) {
+    int ret = backend->queue_cc(port, ccs[i].channel, ccs[i].controller,
+                                ccs[i].value, time);
+    logprintf(LOG_EVENTS, "Port %d:Ch %d:CC %d:%d (queued)\n", port,
+              ccs[i].channel, ccs[i].controller, ccs[i].value);
+    if (ret < 0)
+      return i ? i : ret;
+  }
 
-  return res;
+  return n;
 }
 
-
-/* Send control change message */
+/* Send all queued messages. */
 int
-midi_send_control_change(int channel, int controller, int value)
+midi_flush(void)
 {
-  snd_seq_event_t sendev;
-  snd_seq_ev_clear(&sendev);
-  snd_seq_ev_set_subs(&sendev);
-  snd_seq_ev_set_controller(&sendev, channel - 1, controller, value);
-  snd_seq_ev_set_direct(&sendev);
-  int ret = snd_seq_event_output_direct(seq, &sendev);
-  dbgprintf("Ch %d:CC %d:%d\n", channel, controller, value);
+  return backend->flush();
 }
 
 /* Handle MIDI input. To be called when poll() call in main loop indicates
@@ -162,37 +153,41 @@ midi_send_control_change(int channel, int controller, int value)
 void
 midi_input(void)
 {
-  int midi_status;
-  snd_seq_event_t *ev;
-  ssize_t evlen;
-
-  while (1)
-  {
-    midi_status = snd_seq_event_input(seq, &ev);
-    dbgprintf("MIDI input status : %d\n", midi_status);
-    if (midi_status < 0)
-      break;
-    evlen = snd_seq_event_length(ev);
-    dbgprintf("MIDI event length %d\n", evlen);
-    switch (ev->type) {
-      case SND_SEQ_EVENT_CONTROLLER:
-        dbgprintf("CC: ch %d, param %d, val %d\n", ev->data.control.channel + 1,
-                ev->data.control.param, ev->data.control.value);
-        if (cc_receiver) cc_receiver(ev->data.control.channel,
-                                     ev->data.control.param,
-                                     ev->data.control.value);
-        /* Do something useful here */
-        break;
-      default:
-        break;
-    }
-  }
+  backend->input();
 }
 
+/* Register control change receiver */
 void
-register_midi_cc_reciver(midi_cc_receiver receiver)
+midi_register_cc(midi_cc_receiver receiver)
 {
   cc_receiver = receiver;
 }
 
+/* CC received by backend */
+void
+midi_receive_cc(int port, int ch, int cc, int val)
+{
+  logprintf(LOG_EVENTS, "CC: port %d, ch %d, param %d, val %d\n", port, ch,
+            cc, val);
+  if (cc_receiver)
+    cc_receiver(port, ch, cc, val);
+}
+
+/* Register program change receiver */
+void
+midi_register_program(midi_program_receiver receiver)
+{
+  program_receiver = receiver;
+}
+
+/* Program change received by backend */
+void
+midi_receive_program(int port, int ch, int program)
+{
+  logprintf(LOG_EVENTS, "Program: port %d, ch %d, program %d\n", port, ch,
+            program);
+  if (program_receiver)
+    program_receiver(port, ch, program);
+}
+
 /**************************** End of file midi.c ****************************/
@@ -23,10 +23,15 @@
 #define _MIDI_H_
 
 #include <poll.h>
+#include <stdint.h>
 
 /* Convert two byte MIDI data (7 bits per bytes) to single int */
 #define MIDI_2BYTE(v1, v2) ((((int)(v1)) << 7) | (v2))
 
+/* And back again: most and least significant 7 bits of 14 bit value */
+#define MIDI_MSB(v) (((v) >> 7) & 0x7f)
+#define MIDI_LSB(v) ((v) & 0x7f)
+
 /* Structure for exporting poll fd's from MIDI handler to main loop */
 struct polls
 {
@@ -34,24 +39,114 @@ struct polls
   struct pollfd pollfds[];
 };
 
-/* Control change receiver type */
-typedef void (*midi_cc_receiver)(int ch, int cc, int val);
+/* Control change, for use with midi_queue_control_changes() */
+struct midi_cc
+{
+  int channel; /* 1..16 */
+  int controller;
+  int value;
+};
+
+/* Control change receiver type. port is the port the CC was received on,
+ * ch is the MIDI channel 1..16 */
+typedef void (*midi_cc_receiver)(int port, int ch, int cc, int val);
+
+/* Program change receiver type, likewise */
+typedef void (*midi_program_receiver)(int port, int ch, int program);
+
+/* MIDI backend. The functions below forward to the backend selected with
+ * midi_set_backend(), so that the rest of the application doesn't need to
+ * know what MIDI API is used. */
+struct midi_backend
+{
+  const char *name;
+  /* Set up backend. Return fd's to poll for input, allocated with malloc,
+   * or NULL on failure. */
+  struct polls *(*init)(void);
+  /* Create port. Return port number, or < 0 on failure. */
+  int (*create_port)(const char *name);
+  /* Queue CC on port, channel 1..16, to be delivered midi_offset_us after
+   * time (engine_now() clock, us), or as soon as possible if time is 0 or
+   * scheduling isn't supported. Return < 0 on failure. */
+  int (*queue_cc)(int port, int channel, int controller, int value,
+                  uint64_t time);
+  /* Send everything queued. Return < 0 on failure. */
+  int (*flush)(void);
+  /* Handle input, calling midi_receive_cc() for each CC, and
+   * midi_receive_program() for each program change. */
+  void (*input)(void);
+  /* Connect port to remote device, both ways. NULL if not supported. */
+  int (*connect)(int port, const char *remote_device);
+};
+
+/* Scheduled output, set using -q: if > 0, MIDI is delivered this many us
+ * after the time it was generated, i.e. the time the USB data from the
+ * Nocturn arrived, so that events are evenly spaced regardless of how long
+ * processing takes. 0 = deliver as soon as possible. Set before
+ * midi_init(). */
+extern int midi_offset_us;
+
+/* ALSA sequencer backend */
+extern const struct midi_backend midi_alsa_backend;
+
+/* ALSA rawmidi backend: running status byte stream straight to one device,
+ * e.g. "hw:1,0" or "virtual", shared by all ports. Doesn't support
+ * scheduled output or connecting. */
+extern const struct midi_backend midi_rawmidi_backend;
+extern const char *rawmidi_device;
 
-/* Initialize ALSA sequencer interface, and create MIDI port */
-struct polls *midi_init_alsa(void);
+/* JACK MIDI backend, when built with JACK=1: one JACK MIDI output and input
+ * port per port, with the MIDI placed at the frames corresponding to when
+ * it was generated, one period later (or midi_offset_us later if set). */
+extern const struct midi_backend midi_jack_backend;
 
-/* Send control change */
+/* Select backend. Must be called before midi_init(). */
+void midi_set_backend(const struct midi_backend *backend);
+
+/* Initialize MIDI backend, and create MIDI port */
+struct polls *midi_init(void);
+
+/* Create additional MIDI port. Return port number, or < 0 on failure. */
+int midi_create_port(const char *name);
+
+/* Return number of port created by midi_init() */
+int midi_default_port(void);
+
+/* Send control change on default port */
 int midi_send_control_change(int channel, int controller, int value);
 
+/* Queue control change on port, to be sent on the next midi_flush() */
+int midi_queue_control_change(int port, int channel, int controller,
+                              int value);
+
+/* Queue array of n control changes on port, generated at time (us, see
+ * midi_offset_us), to be sent on the next midi_flush() */
+int midi_queue_control_changes(int port, const struct midi_cc *ccs, int n,
+                               uint64_t time);
+
+/* Send all queued MIDI messages */
+int midi_flush(void);
+
 /* Process any potential incoming MIDI data */
 void midi_input(void);
 
-/* Make bidirectional MIDI connection to specified remote device */
-int midi_connect(const char *remote_device);
+/* Make bidirectional MIDI connection between port and specified remote
+ * device, e.g. "Blofeld" or "24:0" */
+int midi_connect(int port, const char *remote_device);
 
-/* Register sysex receiver */
+/* Register control change receiver */
 void midi_register_cc(midi_cc_receiver receiver);
 
+/* Pass CC received by backend on to receiver. For use by backends. */
+void midi_receive_cc(int port, int ch, int cc, int val);
+
+/* Register program change receiver */
+void midi_register_program(midi_program_receiver receiver);
+
+/* Pass program change received by backend on to receiver. For use by
+ * backends. */
+void midi_receive_program(int port, int ch, int program);
+
 #endif /* _MIDI_H_ */
 
 /************************** End of file midi.h *****************************/
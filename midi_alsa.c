@@ -0,0 +1,323 @@
+/****************************************************************************
+ *
+ * midi_alsa.c - ALSA sequencer MIDI backend
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include <errno.h>
+#include <asoundlib.h>
+
+#include "midi.h"
+#include "engine.h"
+#include "debug.h"
+#include <alloca.h>
+
+/* ALSA related stuff */
+static snd_seq_t *seq;
+
+/* Queue for scheduled output, or -1 if events are sent directly */
+static int queue = -1;
+
+/* engine_now() when queue time was 0 */
+static uint64_t queue_base;
+
+/* Set up and start queue for scheduled output, and find out how its
+ * clock relates to ours. */
+static int
+start_queue(void)
+{
+  snd_seq_queue_status_t *status;
+  const snd_seq_real_time_t *rt;
+  int ret;
+
+  queue = snd_seq_alloc_named_queue(seq, "Nocturn");
+  if (queue < 0) {
+    dbgprintf("Couldn't allocate ALSA queue: %s\n", snd_strerror(queue));
+    return queue;
+  }
+  snd_seq_start_queue(seq, queue, NULL);
+  snd_seq_drain_output(seq);
+
+  snd_seq_queue_status_alloca(&status);
+  ret = snd_seq_get_queue_status(seq, queue, status);
+  if (ret < 0) {
+    dbgprintf("Couldn't get ALSA queue status: %s\n", snd_strerror(ret));
+    snd_seq_free_queue(seq, queue);
+    queue = -1;
+    return ret;
+  }
+  rt = snd_seq_queue_status_get_real_time(status);
+  queue_base = engine_now() -
+               ((uint64_t)rt->tv_sec * 1000000 + rt->tv_nsec / 1000);
+  dbgprintf("Scheduling MIDI output on ALSA queue %d, %d us ahead\n",
+            queue, midi_offset_us);
+
+  return 0;
+}
+
+/* Initialize ALSA sequencer interface */
+/* Return list of fds that main loop needs to poll() in order to detect
+ * activity. */
+/* Returned structure pointer is allocated using malloc. */
+static struct polls *
+alsa_init(void)
+{
+  struct polls *polls;
+  int npfd;
+
+  if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0) {
+    dbgprintf("Couldn't open ALSA sequencer: %s\n", snd_strerror(errno));
+    return NULL;
+  }
+  snd_seq_set_client_name(seq, "Nocturn");
+
+  /* Only have the events we handle delivered, so that clock, notes and
+   * SysEx from a busy host don't wake us up for nothing */
+  if (snd_seq_set_client_event_filter(seq, SND_SEQ_EVENT_CONTROLLER) < 0 ||
+      snd_seq_set_client_event_filter(seq, SND_SEQ_EVENT_PGMCHANGE) < 0)
+    dbgprintf("Couldn't set ALSA event filter, receiving all events\n");
+
+  /* Fetch poll descriptor(s) for MIDI input (normally only one) */
+  npfd = snd_seq_poll_descriptors_count(seq, POLLIN);
+  polls = (struct polls *) malloc(sizeof(struct polls) +
+				  npfd * sizeof(struct pollfd));
+  polls->npfd = npfd;
+  snd_seq_poll_descriptors(seq, polls->pollfds, npfd, POLLIN);
+
+  snd_seq_nonblock(seq, SND_SEQ_NONBLOCK);
+
+  if (midi_offset_us > 0 && start_queue() < 0)
+    printf("Couldn't set up scheduled MIDI output, sending directly\n");
+
+  return polls;
+}
+
+
+/* Create MIDI port. Return port number, or < 0 on failure. */
+static int
+alsa_create_port(const char *name)
+{
+  int port = snd_seq_create_simple_port(seq, name,
+	 			        SND_SEQ_PORT_CAP_READ |
+				        SND_SEQ_PORT_CAP_WRITE |
+				        SND_SEQ_PORT_CAP_SUBS_READ |
+				        SND_SEQ_PORT_CAP_SUBS_WRITE,
+				        SND_SEQ_PORT_TYPE_APPLICATION);
+  if (port < 0)
+    dbgprintf("Couldn't create sequencer port: %s\n", snd_strerror(port));
+
+  return port;
+}
+
+
+/* Set up ALSA MIDI subscription according to supplied parameter. */
+static int
+subscribe(snd_seq_port_subscribe_t *sub)
+{
+  if (snd_seq_get_port_subscription(seq, sub) == 0) {
+    dbgprintf("Connection between editor and device already established\n");
+    return 0;
+  }
+
+  if (snd_seq_subscribe_port(seq, sub) < 0) {
+    dbgprintf("Couldn't estabilsh connection between editor and device\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Make bidirectional MIDI connection between seq_port and specified remote
+ * device */
+static int
+alsa_connect(int seq_port, const char *remote_device)
+{
+  int client;
+  snd_seq_port_subscribe_t *sub;
+  snd_seq_addr_t my_addr;
+  snd_seq_addr_t remote_addr;
+
+  client = snd_seq_client_id(seq);
+  if (client < 0) {
+    dbgprintf("Can't get client_id: %d\n", client);
+    return client;
+  }
+  dbgprintf("Client address %d:%d\n", client, seq_port);
+
+  snd_seq_port_subscribe_alloca(&sub);
+
+  /* My address */
+  my_addr.client = client;
+  my_addr.port = seq_port;
+
+  /* Other devices address */
+  if (snd_seq_parse_address(seq, &remote_addr, remote_device) < 0) {
+    dbgprintf("Can't locate destination device %s\n", remote_device);
+    return -1;
+  }
+
+  /* We always attempt to set up subscription in both directions, regardless
+   * of which error occurs when setting up the first direction. */
+
+  /* Set up sender and destination in subscription. */
+  snd_seq_port_subscribe_set_sender(sub, &my_addr);
+  snd_seq_port_subscribe_set_dest(sub, &remote_addr);
+
+  int res = subscribe(sub);
+
+  /* And now, connection in other direction. */
+  snd_seq_port_subscribe_set_sender(sub, &remote_addr);
+  snd_seq_port_subscribe_set_dest(sub, &my_addr);
+
+  int res2 = subscribe(sub);
+  if (res == 0) res = res2; /* if first subscribe() had no error */
+
+  return res;
+}
+
+
+/* Set up control change event, scheduled for midi_offset_us after time
+ * if we have a queue. Events whose time has already passed are delivered
+ * at once by ALSA. */
+static void
+set_control_change(snd_seq_event_t *ev, int port,
+                   int channel, int controller, int value, uint64_t time)
+{
+  snd_seq_ev_clear(ev);
+  snd_seq_ev_set_source(ev, port);
+  snd_seq_ev_set_subs(ev);
+  snd_seq_ev_set_controller(ev, channel - 1, controller, value);
+  if (queue >= 0 && time > queue_base) {
+    uint64_t us = time - queue_base + midi_offset_us;
+    snd_seq_real_time_t rt = {
+      .tv_sec = us / 1000000,
+      .tv_nsec = (us % 1000000) * 1000
+    };
+
+    snd_seq_ev_schedule_real(ev, queue, 0, &rt);
+  } else
+    snd_seq_ev_set_direct(ev);
+}
+
+/* Number of events queued since last midi_flush() */
+static int queued;
+
+/* Queue control change message. It will be sent on the next alsa_flush(),
+ * or earlier if the ALSA output buffer fills up. */
+static int
+alsa_queue_cc(int port, int channel, int controller, int value,
+              uint64_t time)
+{
+  snd_seq_event_t sendev;
+  set_control_change(&sendev, port, channel, controller, value, time);
+  int ret = snd_seq_event_output(seq, &sendev);
+  if (ret == -EAGAIN) {
+    /* Output buffer full and we're non-blocking; make room and retry. */
+    snd_seq_drain_output(seq);
+    ret = snd_seq_event_output(seq, &sendev);
+  }
+  if (ret >= 0)
+    queued++;
+  return ret;
+}
+
+/* Send all queued messages. */
+static int
+alsa_flush(void)
+{
+  int ret;
+
+  if (!queued)
+    return 0;
+  queued = 0;
+
+  /* In non-blocking mode, a full output pipe gives -EAGAIN */
+  ret = snd_seq_drain_output(seq);
+  if (ret > 0 || ret == -EAGAIN) {
+    /* Couldn't send everything; try again on next flush */
+    queued = 1;
+    ret = 0;
+  }
+
+  return ret;
+}
+
+/* Clamp value from ALSA event to 0..127 */
+static int
+clamp7(int value)
+{
+  return value < 0 ? 0 : value > 127 ? 127 : value;
+}
+
+/* Handle MIDI input. To be called when poll() call in main loop indicates
+ * that data is available on our fd(s). */
+/* The input is drained in batches: everything the kernel has for us is
+ * read into the input buffer in one go, and then taken from the buffer
+ * without further system calls, until nothing is left, as the fd is polled
+ * edge triggered. */
+static void
+alsa_input(void)
+{
+  snd_seq_event_t *ev;
+  int pending;
+  int ret;
+
+  while ((pending = snd_seq_event_input_pending(seq, 1)) > 0) {
+    while (pending-- > 0) {
+      ret = snd_seq_event_input(seq, &ev);
+      if (ret == -ENOSPC) {
+        dbgprintf("ALSA input buffer overrun, MIDI input lost\n");
+        break;
+      }
+      if (ret < 0)
+        return;
+      /* ALSA doesn't restrict the fields to what MIDI can carry, and the
+       * values end up in the data sent to the Nocturn, where anything
+       * over 127 would be taken as a status byte */
+      if (ev->data.control.channel > 15)
+        continue;
+      switch (ev->type) {
+        case SND_SEQ_EVENT_CONTROLLER:
+          if (ev->data.control.param > 127)
+            break;
+          midi_receive_cc(ev->dest.port, ev->data.control.channel + 1,
+                          ev->data.control.param,
+                          clamp7(ev->data.control.value));
+          break;
+        case SND_SEQ_EVENT_PGMCHANGE:
+          midi_receive_program(ev->dest.port, ev->data.control.channel + 1,
+                               clamp7(ev->data.control.value));
+          break;
+        default:
+          break;
+      }
+    }
+  }
+}
+
+const struct midi_backend midi_alsa_backend = {
+  .name = "alsa",
+  .init = alsa_init,
+  .create_port = alsa_create_port,
+  .queue_cc = alsa_queue_cc,
+  .flush = alsa_flush,
+  .input = alsa_input,
+  .connect = alsa_connect,
+};
+
+/************************* End of file midi_alsa.c ***************************/
@@ -0,0 +1,273 @@
+/****************************************************************************
+ *
+ * midi_jack.c - JACK MIDI backend
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+#include "midi.h"
+#include "spsc.h"
+#include "engine.h"
+#include "debug.h"
+
+/* Max number of ports, i.e. Nocturns */
+#define JACK_PORTS 8
+
+/* Size of rings to and from the JACK process thread, in messages */
+#define JACK_RING 4096
+
+/* MIDI message passed to or from the process thread */
+struct jack_msg
+{
+  uint64_t time;  /* engine_now() clock, us, 0 = as soon as possible */
+  uint8_t port;
+  uint8_t len;
+  uint8_t data[3];
+};
+
+static jack_client_t *client;
+static jack_port_t *out_ports[JACK_PORTS];
+static jack_port_t *in_ports[JACK_PORTS];
+static int nports;          /* written by main thread, read by process */
+
+static struct spsc out_ring; /* main thread -> process thread */
+static struct spsc in_ring;  /* process thread -> main thread */
+static int in_wakeup = -1;   /* eventfd, tells main thread about input */
+
+static int64_t clock_offset; /* jack_get_time() - engine_now() */
+static int lost;             /* messages that didn't fit */
+
+/* Frame time at which message is to be output, given as us on our clock.
+ * Without -q, everything is delayed by one period, so that messages
+ * received during one period come out evenly spaced in the next. */
+static jack_nframes_t
+msg_frame(const struct jack_msg *msg, jack_nframes_t nframes)
+{
+  jack_time_t t = msg->time + clock_offset + midi_offset_us;
+
+  return jack_time_to_frames(client, t) + (midi_offset_us ? 0 : nframes);
+}
+
+/* JACK process callback, run in JACK's real-time thread:
+ * write messages that are due in this period to the output port buffers,
+ * at the frame offsets corresponding to their timestamps, and pass input
+ * on to the main thread. */
+static int
+jack_process(jack_nframes_t nframes, void *arg)
+{
+  jack_nframes_t start = jack_last_frame_time(client);
+  int n = __atomic_load_n(&nports, __ATOMIC_ACQUIRE);
+  void *out_bufs[JACK_PORTS];
+  jack_nframes_t last[JACK_PORTS];
+  const struct jack_msg *msg;
+  struct jack_msg in;
+  uint64_t one = 1;
+  int woken = 0;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    out_bufs[i] = jack_port_get_buffer(out_ports[i], nframes);
+    jack_midi_clear_buffer(out_bufs[i]);
+    last[i] = 0;
+  }
+
+  while ((msg = spsc_peek(&out_ring))) {
+    jack_nframes_t offset = 0;
+
+    if (msg->time) {
+      int32_t diff = (int32_t)(msg_frame(msg, nframes) - start);
+
+      if (diff >= (int32_t)nframes)
+        break; /* for a later period */
+      if (diff > 0)
+        offset = diff;
+    }
+    if (msg->port < n) {
+      /* Events in a buffer must be in time order */
+      if (offset < last[msg->port])
+        offset = last[msg->port];
+      last[msg->port] = offset;
+      if (jack_midi_event_write(out_bufs[msg->port], offset, msg->data,
+                                msg->len))
+        __atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+    }
+    spsc_pop(&out_ring, NULL);
+  }
+
+  for (i = 0; i < n; i++) {
+    void *buf = jack_port_get_buffer(in_ports[i], nframes);
+    uint32_t count = jack_midi_get_event_count(buf);
+    jack_midi_event_t ev;
+    uint32_t j;
+
+    for (j = 0; j < count; j++) {
+      if (jack_midi_event_get(&ev, buf, j) || ev.size < 2 || ev.size > 3)
+        continue;
+      in.time = 0;
+      in.port = i;
+      in.len = ev.size;
+      memcpy(in.data, ev.buffer, ev.size);
+      if (spsc_push(&in_ring, &in) < 0)
+        __atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+      else
+        woken = 1;
+    }
+  }
+
+  /* If this fails, the counter is full, and the main thread has been
+   * told about input already */
+  if (woken && write(in_wakeup, &one, sizeof(one)) < 0)
+    woken = 0;
+
+  return 0;
+}
+
+/* Connect to JACK server. The eventfd signalling input is the fd to poll. */
+static struct polls *
+jack_init(void)
+{
+  struct polls *polls;
+  jack_status_t status;
+
+  if (spsc_init(&out_ring, JACK_RING, sizeof(struct jack_msg)) < 0 ||
+      spsc_init(&in_ring, JACK_RING, sizeof(struct jack_msg)) < 0)
+    return NULL;
+
+  in_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (in_wakeup < 0)
+    return NULL;
+
+  client = jack_client_open("Nocturn", JackNoStartServer, &status);
+  if (!client) {
+    dbgprintf("Couldn't connect to JACK server: 0x%x\n", (int)status);
+    return NULL;
+  }
+  clock_offset = (int64_t)jack_get_time() - (int64_t)engine_now();
+
+  jack_set_process_callback(client, jack_process, NULL);
+  if (jack_activate(client)) {
+    dbgprintf("Couldn't activate JACK client\n");
+    jack_client_close(client);
+    client = NULL;
+    return NULL;
+  }
+
+  polls = malloc(sizeof(struct polls) + sizeof(struct pollfd));
+  if (!polls)
+    return NULL;
+  polls->npfd = 1;
+  polls->pollfds[0].fd = in_wakeup;
+  polls->pollfds[0].events = POLLIN;
+  polls->pollfds[0].revents = 0;
+
+  return polls;
+}
+
+/* Create MIDI output and input port pair */
+static int
+jack_create_port(const char *name)
+{
+  char in_name[64];
+  int port = nports;
+
+  if (port >= JACK_PORTS) {
+    dbgprintf("Too many JACK ports\n");
+    return -1;
+  }
+
+  snprintf(in_name, sizeof(in_name), "%s in", name);
+  out_ports[port] = jack_port_register(client, name, JACK_DEFAULT_MIDI_TYPE,
+                                       JackPortIsOutput, 0);
+  in_ports[port] = jack_port_register(client, in_name,
+                                      JACK_DEFAULT_MIDI_TYPE,
+                                      JackPortIsInput, 0);
+  if (!out_ports[port] || !in_ports[port]) {
+    dbgprintf("Couldn't register JACK ports for %s\n", name);
+    return -1;
+  }
+
+  /* Only now may the process thread use them */
+  __atomic_store_n(&nports, port + 1, __ATOMIC_RELEASE);
+
+  return port;
+}
+
+/* Queue control change for the process thread */
+static int
+jack_queue_cc(int port, int channel, int controller, int value,
+              uint64_t time)
+{
+  struct jack_msg msg = {
+    .time = time,
+    .port = port,
+    .len = 3,
+    .data = { 0xb0 | (channel - 1), controller & 0x7f, value & 0x7f }
+  };
+
+  return spsc_push(&out_ring, &msg) < 0 ? -EAGAIN : 0;
+}
+
+/* Nothing to do, the process thread picks up the messages by itself.
+ * Report messages lost since last time as a failure, though. */
+static int
+jack_flush(void)
+{
+  return __atomic_exchange_n(&lost, 0, __ATOMIC_RELAXED) ? -ENOBUFS : 0;
+}
+
+/* Pass on input from the process thread */
+static void
+jack_input(void)
+{
+  struct jack_msg msg;
+  uint64_t count;
+
+  if (read(in_wakeup, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    errprintf("Couldn't read JACK wakeup count: %d\n", errno);
+
+  while (!spsc_pop(&in_ring, &msg)) {
+    int channel = (msg.data[0] & 0x0f) + 1;
+
+    /* JACK passes on whatever the client wrote, so the data bytes need
+     * not be valid */
+    if ((msg.data[0] & 0xf0) == 0xb0 && msg.len == 3)
+      midi_receive_cc(msg.port, channel, msg.data[1] & 0x7f,
+                      msg.data[2] & 0x7f);
+    else if ((msg.data[0] & 0xf0) == 0xc0)
+      midi_receive_program(msg.port, channel, msg.data[1] & 0x7f);
+  }
+}
+
+const struct midi_backend midi_jack_backend = {
+  .name = "jack",
+  .init = jack_init,
+  .create_port = jack_create_port,
+  .queue_cc = jack_queue_cc,
+  .flush = jack_flush,
+  .input = jack_input,
+};
+
+/************************* End of file midi_jack.c *************************/
@@ -0,0 +1,218 @@
+/****************************************************************************
+ *
+ * midi_rawmidi.c - ALSA rawmidi MIDI backend
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <asoundlib.h>
+
+#include "midi.h"
+#include "debug.h"
+
+/* Output buffer size. Everything queued between flushes normally fits,
+ * but if not, what's there is written out to make room. */
+#define RAW_BUFSIZE 4096
+
+/* Device to open, set using -R */
+const char *rawmidi_device;
+
+static snd_rawmidi_t *raw_in;  /* NULL if device has no input */
+static snd_rawmidi_t *raw_out;
+
+/* Output buffer, and running status of what's in it */
+static uint8_t outbuf[RAW_BUFSIZE];
+static int outlen;
+static int out_status = -1;
+
+/* Input parser state */
+static int in_status = -1;
+static uint8_t in_data[2];
+static int in_count;
+
+/* Number of ports created; they all share the device */
+static int ports;
+
+/* Open rawmidi device. Return fd's to poll for input. */
+static struct polls *
+raw_init(void)
+{
+  struct polls *polls;
+  int npfd = 0;
+  int ret;
+
+  if (!rawmidi_device) {
+    errprintf("No rawmidi device given\n");
+    return NULL;
+  }
+
+  /* Not all devices have an input, but we want it if there is one */
+  ret = snd_rawmidi_open(&raw_in, &raw_out, rawmidi_device,
+                         SND_RAWMIDI_NONBLOCK);
+  if (ret < 0) {
+    raw_in = NULL;
+    ret = snd_rawmidi_open(NULL, &raw_out, rawmidi_device,
+                           SND_RAWMIDI_NONBLOCK);
+  }
+  if (ret < 0) {
+    dbgprintf("Couldn't open rawmidi device %s: %s\n", rawmidi_device,
+              snd_strerror(ret));
+    return NULL;
+  }
+
+  if (raw_in)
+    npfd = snd_rawmidi_poll_descriptors_count(raw_in);
+  polls = malloc(sizeof(struct polls) + npfd * sizeof(struct pollfd));
+  if (!polls)
+    return NULL;
+  polls->npfd = npfd;
+  if (npfd)
+    snd_rawmidi_poll_descriptors(raw_in, polls->pollfds, npfd);
+  dbgprintf("Opened rawmidi device %s%s\n", rawmidi_device,
+            raw_in ? "" : ", output only");
+
+  return polls;
+}
+
+/* There's only one byte stream, so all ports share it */
+static int
+raw_create_port(const char *name)
+{
+  return ports++;
+}
+
+/* Write out as much of the output buffer as the device takes. Return
+ * < 0 on failure. */
+static int
+raw_write(void)
+{
+  ssize_t ret;
+
+  if (!outlen)
+    return 0;
+
+  ret = snd_rawmidi_write(raw_out, outbuf, outlen);
+  if (ret == -EAGAIN)
+    return 0; /* try again on next flush */
+  if (ret < 0) {
+    /* Whatever is lost, the receiver no longer knows the status */
+    outlen = 0;
+    out_status = -1;
+    return ret;
+  }
+  outlen -= ret;
+  memmove(outbuf, outbuf + ret, outlen);
+
+  return 0;
+}
+
+/* Queue control change, using running status */
+static int
+raw_queue_cc(int port, int channel, int controller, int value,
+             uint64_t time)
+{
+  int status = 0xb0 | (channel - 1);
+
+  if (outlen + 3 > RAW_BUFSIZE) {
+    int ret = raw_write();
+
+    if (ret < 0)
+      return ret;
+    if (outlen + 3 > RAW_BUFSIZE)
+      return -EAGAIN;
+  }
+
+  if (status != out_status) {
+    outbuf[outlen++] = status;
+    out_status = status;
+  }
+  outbuf[outlen++] = controller & 0x7f;
+  outbuf[outlen++] = value & 0x7f;
+
+  return 0;
+}
+
+/* Send everything queued */
+static int
+raw_flush(void)
+{
+  return raw_write();
+}
+
+/* Handle complete message received */
+static void
+raw_message(void)
+{
+  int channel = (in_status & 0x0f) + 1;
+
+  switch (in_status & 0xf0) {
+    case 0xb0:
+      midi_receive_cc(midi_default_port(), channel, in_data[0], in_data[1]);
+      break;
+    case 0xc0:
+      midi_receive_program(midi_default_port(), channel, in_data[0]);
+      break;
+  }
+}
+
+/* Parse byte stream from device, handling running status */
+static void
+raw_input(void)
+{
+  uint8_t buf[256];
+  ssize_t len;
+  int i;
+
+  if (!raw_in)
+    return;
+
+  while ((len = snd_rawmidi_read(raw_in, buf, sizeof(buf))) > 0)
+    for (i = 0; i < len; i++) {
+      uint8_t byte = buf[i];
+
+      if (byte >= 0xf8)
+        continue; /* real time messages can come anywhere */
+      if (byte & 0x80) {
+        /* System common messages cancel running status */
+        in_status = byte < 0xf0 ? byte : -1;
+        in_count = 0;
+        continue;
+      }
+      if (in_status < 0)
+        continue;
+
+      in_data[in_count++] = byte;
+      /* Program change and channel pressure have one data byte */
+      if (in_count == (((in_status & 0xe0) == 0xc0) ? 1 : 2)) {
+        raw_message();
+        in_count = 0;
+      }
+    }
+}
+
+const struct midi_backend midi_rawmidi_backend = {
+  .name = "rawmidi",
+  .init = raw_init,
+  .create_port = raw_create_port,
+  .queue_cc = raw_queue_cc,
+  .flush = raw_flush,
+  .input = raw_input,
+};
+
+/************************ End of file midi_rawmidi.c ***********************/
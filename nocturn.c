@@ -20,11 +20,31 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <libusb.h> /* This also brings in thing like uint8_t etc */
 
 #include "debug.h"
 #include "midi.h"
+#include "engine.h"
+#include "parser.h"
+#include "router.h"
+#include "leds.h"
+#include "device.h"
+#include "tx.h"
+#include "spsc.h"
+#include "stats.h"
+#include "metrics.h"
+#include "capture.h"
+#include "bank.h"
+#include "control.h"
 
 #define USB_DEBUG 0
 
@@ -36,26 +56,10 @@ struct usb_info {
   struct libusb_device_handle *devh;
   uint8_t rx_ep;
   uint8_t tx_ep;
+  int tx_packetsize;    /* max packet size of tx_ep */
+  int resolved;         /* endpoints above have been found */
 };
 
-/* Magical initiation strings.
- * From De Wet van Niekerk (dewert) - dvan.ca - dewert@gmail.com
- * (Github: dewert/nocturn-linux-midi)
- * The protocol was reverse-engineered by Timo A. Hummel (felicitus on github).
- * 
- * In fact there is nothing magical about this. 0xB0 is the MIDI status
- * byte for Control Change, and after that it's all a question of running
- * status, i.e. the whole set of strings is just a series of control change
- * messages.
- * The question is then what the contol change data actually does. I have not
- * taken a closer look at the CC numbers used to see if they for instance
- * overlap with CC numbers used to control the LED rings etc on the Nocturn.
- * At least one of them seems to affect some the timeout of some messages
- * sent by the Nocturn. But apart from that, this "initialization" is not
- * necessary to get the Nocturn working, and can be omitted.
- */
-char *init_data[] = { "b00000", "28002b4a2c002e35", "2a022c722e30", "7f00" };
-
 /*
  * CC definitions for Nocturn:
  * Note that since this isn't really MIDI, some of the CC's overlap with
@@ -87,154 +91,297 @@ char *init_data[] = { "b00000", "28002b4a2c002e35", "2a022c722e30", "7f00" };
  */
 
 
-/* Processed finished event. Called whenever a complete event has
- * been assemebled. */
-void event(int status, int chan, int data1, int data2)
-{
-  if (status == 176) {
-    /* 96 .. 103 range is knob 1..8 presses which seem to be very jittery. */
-    if (data1 < 96 || data1 > 103)
-      printf("Status %d (chan %d): %d,%d\n", status, chan, data1, data2);
-#ifdef CC72_TEST
-    /* Simple test: map data slider to CC 69 = F1 cutoff on Blofeld */
-    if (data1 == 72)
-      if (midi_send_control_change(1, 69, data2) < 0)
-        printf("Couldn't send midi\n");
-#else
-    if (midi_send_control_change(1, data1, data2) < 0)
-      printf("Couldn't send midi\n");
+/* Ring of interrupt IN transfers. All transfers are kept submitted at all
+ * times, each one being resubmitted directly from the receive callback, so
+ * that there is always at least one transfer in flight, even while we are
+ * busy processing the data from the previous one. */
+#define RX_BUFSIZE 10
+#define RX_TRANSFERS 4 /* default number of transfers in ring */
 
-#endif
-  }
-}
+struct nocturn;
+
+struct rx_ring {
+  struct nocturn *nocturn; /* device ring belongs to */
+  int ntransfers;    /* number of transfers in ring */
+  int active;        /* number of transfers submitted, changed atomically */
+  int stat;          /* first error encountered, 0 if none */
+  struct libusb_transfer **transfers;
+  uint8_t *bufs;     /* ntransfers * RX_BUFSIZE bytes */
+};
+
+/* One Nocturn. The structure is kept when the device is disconnected, and
+ * reused if a device turns up on the same USB port again, so that the state
+ * of its controls and LEDs, as well as its ALSA port, survive reconnecting. */
+struct nocturn {
+  struct nocturn *next;
+  struct device dev;    /* state and data path, apart from USB */
+  char path[32];        /* USB bus and port path, e.g. "1-2.3" */
+  int port;             /* ALSA port */
+  int connected;
+  int gone;             /* device has been unplugged, or not found */
+  int reconnecting;     /* device has been connected before */
+  struct usb_info usb_info;
+  struct rx_ring ring;  /* receive transfers */
+  struct tx_queue tx;   /* data waiting to be sent to device */
+};
+
+/* All devices we have seen */
+static struct nocturn *nocturns;
+
+/* Number of transfers in RX ring, set using -r */
+int rx_transfers = RX_TRANSFERS;
+
+/* Low latency mode, set using -l: flush MIDI output after each received
+ * USB transfer, rather than once per main loop pass. */
+int low_latency = 0;
+
+/* Threaded mode, set using -t.
+ * Normally everything runs in the main loop. In threaded mode, libusb event
+ * handling, i.e. rx_cb() and the parser, runs in a separate thread with
+ * real-time priority, so that a slow terminal or ALSA doesn't delay input
+ * from the Nocturn. The USB thread and the main loop only talk through two
+ * lock-free rings: parsed events go from the USB thread to the main loop,
+ * which routes them to ALSA, and LED updates go from the main loop to the
+ * USB thread, which queues them for the Nocturn.
+ * libusb callbacks are only ever run by the thread holding the libusb event
+ * lock, which is the USB thread except while the main loop is waiting for
+ * transfers to be cancelled, so there is still only one producer at a time
+ * for the event ring. Connecting and disconnecting devices is done by the
+ * main loop while holding tx_lock, which keeps the USB thread from queueing
+ * LED updates in the meantime. All transfers to the Nocturn are submitted
+ * by the USB thread, as the transfer callback modifies the transmit queue
+ * without taking tx_lock: the main loop only queues the start-up script
+ * when connecting, and leaves it to the USB thread to send it. The
+ * counters of transfers in flight are changed atomically, as the main loop
+ * waits for them to drop to 0 when disconnecting, while the callbacks may
+ * be running on the USB thread. */
+int threaded = 0;
+
+#define USB_THREAD_PRIORITY 60 /* SCHED_FIFO priority for USB thread */
+#define EVENT_RING 256         /* max events waiting for main loop */
+#define LED_RING 1024          /* max LED updates waiting for USB thread */
+
+/* Event from Nocturn, on its way to the router */
+struct usb_event {
+  struct device *device;
+  uint64_t time;               /* when it was received */
+  struct nocturn_event event;
+};
 
-enum midi_state { STATUS, DATA1, DATA2 };
+/* LED update, on its way to the Nocturn */
+struct led_update {
+  struct nocturn *nocturn;
+  uint8_t cc;
+  uint8_t value;
+};
 
-/* Process MIDI-like data from Nocturn. Handle running status. */
-void process(int data)
+static struct spsc event_ring;  /* USB thread to main loop */
+static struct spsc led_ring;    /* main loop to USB thread */
+static int events_dropped;      /* events lost because event_ring was full */
+static int usb_wakeup = -1;     /* eventfd for waking main loop */
+static libusb_context *usb_ctx;
+static pthread_t usb_thread;
+static int usb_thread_quit;
+static pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Wake up main loop, e.g. because a device has failed. Can be called from
+ * either thread. */
+void main_wakeup(void)
 {
-  static enum midi_state state = STATUS;
-  static int status = -1;
-  static int chan = -1;
-  static int data1;
-  data &= 0xff; /* get rid of sign bit from potential cast */
+  uint64_t one = 1;
 
-  if (data & 0x80) {
-    status = data & 0xf0;
-    chan = data & 0x0f;
-    state = DATA1;
-  } else 
-    /* data bytes */
-    switch (state) {
-      case STATUS: break; /* Shouldn't happen */
-      case DATA1: data1 = data; state = DATA2; break;
-      case DATA2: event(status, chan, data1, data);
-                  state = DATA1;
-                  break;
-      default: break;
-  }
+  if (usb_wakeup >= 0 && write(usb_wakeup, &one, sizeof(one)) < 0 &&
+      errno != EAGAIN)
+    errprintf("Couldn't wake up main loop: %d\n", errno);
 }
 
-/* Process buffer of data from Nocturn */
-void process_buffer(const char *data, int len)
+/* Wake up USB thread, e.g. because there are LED updates for it */
+void usb_thread_wakeup(void)
 {
-  while (len--)
-    process(*data++);
+  if (threaded)
+    libusb_interrupt_event_handler(usb_ctx);
+}
+
+/* Pass events parsed on the USB thread on to the main loop, keeping the
+ * time we got them, for the benefit of the edit map and the latency
+ * statistics */
+void queue_events(struct device *device, const struct nocturn_event *events,
+                  int nevents, uint64_t rx)
+{
+  struct usb_event ev;
+  int i;
+
+  ev.device = device;
+  ev.time = rx;
+  for (i = 0; i < nevents; i++) {
+    ev.event = events[i];
+    if (spsc_push(&event_ring, &ev) < 0) {
+      __atomic_add_fetch(&events_dropped, 1, __ATOMIC_RELAXED);
+      metrics_add(METRIC_EVENTS_DROPPED, 1);
+    }
+  }
+  main_wakeup();
 }
 
 /* Receive callback. Called when we get data from Nocturn. */
 void rx_cb(struct libusb_transfer *transfer)
 {
-  int *resubmit = transfer->user_data;
-  *resubmit = 1;
+  struct rx_ring *ring = transfer->user_data;
+  uint64_t rx = engine_now();
+  int stat;
 
-  if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-    process_buffer(transfer->buffer, transfer->actual_length);
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+      metrics_add(METRIC_RX_COMPLETED, 1);
+      capture_rx(ring->nocturn->dev.index, rx, transfer->buffer,
+                 transfer->actual_length);
+      device_process_buffer(&ring->nocturn->dev, transfer->buffer,
+                            transfer->actual_length, rx);
+      if (low_latency && !threaded) {
+        midi_flush();
+        stats_flushed(engine_now());
+      }
 #if 0
-    int i; for (i = 0; i < transfer->actual_length; i++)
-      printf("%d ", transfer->buffer[i]);
-    printf("\n");
+      int i; for (i = 0; i < transfer->actual_length; i++)
+        printf("%d ", transfer->buffer[i]);
+      printf("\n");
 #endif
+      break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      metrics_add(METRIC_RX_TIMED_OUT, 1);
+      break;
+    case LIBUSB_TRANSFER_CANCELLED:
+      metrics_add(METRIC_RX_CANCELLED, 1);
+      __atomic_sub_fetch(&ring->active, 1, __ATOMIC_RELEASE);
+      return;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      metrics_add(METRIC_RX_NO_DEVICE, 1);
+      __atomic_sub_fetch(&ring->active, 1, __ATOMIC_RELEASE);
+      if (!ring->stat) ring->stat = LIBUSB_ERROR_NO_DEVICE;
+      main_wakeup();
+      return;
+    default:
+      metrics_add(METRIC_RX_ERROR, 1);
+      __atomic_sub_fetch(&ring->active, 1, __ATOMIC_RELEASE);
+      if (!ring->stat) ring->stat = LIBUSB_ERROR_IO;
+      main_wakeup();
+      return;
   }
-}
 
+  /* Don't resubmit if we're on our way out */
+  if (ring->stat) {
+    __atomic_sub_fetch(&ring->active, 1, __ATOMIC_RELEASE);
+    return;
+  }
 
-/* Convert character 0123456789abcdef -> 0..15 */
-int digit(uint8_t hexdigit)
-{
-  return hexdigit - '0' - ((hexdigit > '9') ? ('a' - ('9' + 1)) : 0);
+  stat = libusb_submit_transfer(transfer);
+  if (stat < 0) {
+    printf("resubmitting transfer: %d\n", stat);
+    __atomic_sub_fetch(&ring->active, 1, __ATOMIC_RELEASE);
+    ring->stat = stat;
+    main_wakeup();
+  }
 }
 
-/* Convert string of two hex chars to byte 0..255 */
-int byte(const char *string)
+/* Allocate and fill ring of ntransfers receive transfers for device.
+ * Return 0 if ok, LIBUSB_ERROR_foo if failure. */
+int rx_ring_alloc(struct rx_ring *ring, struct nocturn *nocturn,
+                  int ntransfers)
 {
-  return (digit(string[0]) << 4) | digit(string[1]);
-}
+  int i;
 
-/* Simple send data to Nocturn */
-int send_data(libusb_device_handle *devh, uint8_t endpoint,
-              uint8_t *buf, int len, int *written)
-{
-  return libusb_interrupt_transfer(devh, endpoint, buf, len, written, 500);
+  ring->nocturn = nocturn;
+  ring->ntransfers = 0;
+  ring->active = 0;
+  ring->stat = 0;
+  ring->transfers = calloc(ntransfers, sizeof(struct libusb_transfer *));
+  ring->bufs = calloc(ntransfers, RX_BUFSIZE);
+  if (!ring->transfers || !ring->bufs)
+    return LIBUSB_ERROR_NO_MEM;
+
+  for (i = 0; i < ntransfers; i++) {
+    struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+    if (!transfer)
+      return LIBUSB_ERROR_NO_MEM;
+    /* No timeout, since the transfer is resubmitted on completion anyway */
+    libusb_fill_interrupt_transfer(transfer,
+                                   nocturn->usb_info.devh,
+                                   nocturn->usb_info.rx_ep,
+                                   ring->bufs + i * RX_BUFSIZE, RX_BUFSIZE,
+                                   rx_cb, ring,
+                                   0);
+    ring->transfers[ring->ntransfers++] = transfer;
+  }
+
+  return 0;
 }
 
-/* Send hexadecimal string to Nocturn */
-int send_hexdata(libusb_device_handle *devh, uint8_t endpoint,
-                 const char *string, int *written)
+/* Submit all transfers in ring. */
+int rx_ring_submit(struct rx_ring *ring)
 {
-  uint8_t buf[80];
-  uint8_t *p = buf;
+  int i;
+  int stat;
 
-  printf("%s: to send %s\n", __func__, string);
-  while (*string) {
-    *p++ = byte(string);
-    string += 2;
+  for (i = 0; i < ring->ntransfers; i++) {
+    /* Counted first, as the USB thread may see it complete before libusb
+     * returns */
+    __atomic_add_fetch(&ring->active, 1, __ATOMIC_RELAXED);
+    stat = libusb_submit_transfer(ring->transfers[i]);
+    if (stat < 0) {
+      printf("submitting transfer: %d\n", stat);
+      __atomic_sub_fetch(&ring->active, 1, __ATOMIC_RELAXED);
+      ring->stat = stat;
+      return stat;
+    }
   }
-  printf("Sending %d bytes: %d %d %d ...\n", p - buf, buf[0], buf[1], buf[2]);
 
-  return send_data(devh, endpoint, buf, p - buf, written);
+  return 0;
 }
 
+/* Cancel any outstanding transfers in ring, wait for them to be returned
+ * to us, and free everything. */
+void rx_ring_free(libusb_context *ctx, struct rx_ring *ring)
+{
+  int i;
+
+  if (!ring->stat)
+    ring->stat = LIBUSB_ERROR_INTERRUPTED; /* stop resubmissions */
 
-/* Try to connect to Nocturn. 
- * Return 0 if ok, with usb_info filled in.
- * Return LIBUSB_ERROR_foo if failure. */
-int usb_connect(libusb_context *ctx, struct usb_info *usb_info)
+  for (i = 0; i < ring->ntransfers; i++)
+    libusb_cancel_transfer(ring->transfers[i]);
+  while (__atomic_load_n(&ring->active, __ATOMIC_ACQUIRE) > 0)
+    if (libusb_handle_events(ctx) < 0)
+      break;
+
+  for (i = 0; i < ring->ntransfers; i++)
+    libusb_free_transfer(ring->transfers[i]);
+  free(ring->transfers);
+  free(ring->bufs);
+  ring->transfers = NULL;
+  ring->bufs = NULL;
+  ring->ntransfers = 0;
+}
+
+/* Find endpoints of Nocturn dev, and fill them in in usb_info.
+ * Return 0 if ok, LIBUSB_ERROR_foo if failure. */
+int usb_endpoints(struct libusb_device *dev, struct usb_info *usb_info)
 {
   int stat;
-  struct libusb_device *dev;
-  struct libusb_device_handle *devh;
-  struct libusb_device_descriptor descr;
   uint8_t ep0, ep1;
-  uint8_t rx_ep = -1, tx_ep = -1;
+  int rx_ep = -1, tx_ep = -1;
 
-  devh = libusb_open_device_with_vid_pid(ctx, vid_novation, pid_nocturn);
-  if (!devh) {
-    printf("Couldn't find Nocturn at %04x:%04x\n", vid_novation, pid_nocturn);
-    return LIBUSB_ERROR_NO_DEVICE;
-  }
 #if USB_DEBUG
-  printf("Got USB device: %p\n", devh);
-#endif
-
-  dev = libusb_get_device(devh);
-  if (!dev) {
-    printf("getting usb device: %d\n", stat);
-    return LIBUSB_ERROR_NO_DEVICE;
-  }
+  struct libusb_device_descriptor descr;
   stat = libusb_get_device_descriptor(dev, &descr);
   if (stat < 0) {
     printf("getting usb device descriptor: %d\n", stat);
     return stat;
   }
-#if USB_DEBUG
   printf("Descr: vendor %04x, product %04x\n",
          descr.idVendor, descr.idProduct);
   printf("Configurations: %d\n", descr.bNumConfigurations);
-#endif
 
   /* We don't really need configuration descriptor #0 */
-#if USB_DEBUG
   struct libusb_config_descriptor *config0;
   stat = libusb_get_config_descriptor(dev, 0, &config0);
   if (stat < 0) {
@@ -249,6 +396,7 @@ int usb_connect(libusb_context *ctx, struct usb_info *usb_info)
   printf("Interface 0: i/f 0 ep 0 poll interval %d\n", config0->interface[0].altsetting[0].endpoint[0].bInterval);
   printf("Interface 0: i/f 0 ep 1 %d\n", config0->interface[0].altsetting[0].endpoint[1].bEndpointAddress);
   printf("Interface 0: i/f 0 ep 1 poll interval %d\n", config0->interface[0].altsetting[0].endpoint[1].bInterval);
+  libusb_free_config_descriptor(config0);
 #endif
 
   struct libusb_config_descriptor *config1;
@@ -276,330 +424,1374 @@ int usb_connect(libusb_context *ctx, struct usb_info *usb_info)
   /* bit 7 set indicates a receiving endpoint */
   if (ep0 & 128) rx_ep = ep0; else tx_ep = ep0;
   if (ep1 & 128) rx_ep = ep1; else tx_ep = ep1;
+  usb_info->tx_packetsize = config1->interface[0].altsetting[0]
+                              .endpoint[(ep0 & 128) ? 1 : 0].wMaxPacketSize;
+  libusb_free_config_descriptor(config1);
   if (tx_ep < 0 || rx_ep < 0) {
     printf("Failed to set rx and tx endpoints\n");
     return LIBUSB_ERROR_NO_DEVICE;
   }
 
-  /* Set configuration #1 */
-  stat = libusb_set_configuration(devh, 1);
+  usb_info->rx_ep = rx_ep;
+  usb_info->tx_ep = tx_ep;
+  usb_info->resolved = 1;
+
+  return 0;
+}
+
+/* Try to connect to Nocturn dev.
+ * Return 0 if ok, with usb_info filled in.
+ * Return LIBUSB_ERROR_foo if failure. */
+/* The endpoints found the first time are kept in usb_info, which stays
+ * with the USB port the Nocturn is plugged into, so reconnecting doesn't
+ * need to go through the descriptors again. */
+int usb_connect(struct libusb_device *dev, struct usb_info *usb_info)
+{
+  int stat;
+  int config;
+  struct libusb_device_handle *devh;
+
+  if (!usb_info->resolved) {
+    stat = usb_endpoints(dev, usb_info);
+    if (stat < 0)
+      return stat;
+  }
+
+  stat = libusb_open(dev, &devh);
   if (stat < 0) {
-    printf("setting usb configuration: %d\n", stat);
+    printf("opening usb device: %d\n", stat);
     return stat;
   }
+#if USB_DEBUG
+  printf("Got USB device: %p\n", devh);
+#endif
 
-  libusb_detach_kernel_driver(devh, 0); /* need this ? */
+  /* Set configuration #1, unless it is already, which it normally is
+   * after the first time; setting it resets the device. */
+  if (libusb_get_configuration(devh, &config) < 0 || config != 1) {
+    stat = libusb_set_configuration(devh, 1);
+    if (stat < 0) {
+      printf("setting usb configuration: %d\n", stat);
+      goto fail;
+    }
+  }
+
+  if (libusb_kernel_driver_active(devh, 0) == 1)
+    libusb_detach_kernel_driver(devh, 0);
   stat = libusb_claim_interface(devh, 0);
   if (stat < 0) {
     printf("claiming usb interface: %d\n", stat);
-    return stat;
+    goto fail;
   }
 
   /* Now we're set up and ready to communicate */
 
   usb_info->devh = devh;
-  usb_info->rx_ep = rx_ep;
-  usb_info->tx_ep = tx_ep;
 
   return 0;
+
+fail:
+  libusb_close(devh);
+  return stat;
 }
 
 
-/* Send start-up stuff to Nocturn, if necessary */
-int nocturn_init(struct usb_info *usb_info)
+/* Queue start-up script for Nocturn. It goes out in the same transfer(s)
+ * as the LED state queued after it, when the caller calls tx_kick(), or
+ * in threaded mode wakes up the USB thread. */
+int nocturn_init(struct nocturn *nocturn)
+{
+  if (!init_script_len)
+    return 0;
+
+  dbgprintf("Sending %d bytes of start-up script\n", init_script_len);
+  return tx_queue_script(&nocturn->tx, init_script, init_script_len);
+}
+
+/* USB and MIDI event sources.
+ * All fd's are registered edge triggered with the event engine, each with
+ * its own handler, so that libusb is only called when there is USB activity,
+ * and ALSA only when there is MIDI input. The set of libusb fd's is
+ * maintained by the libusb pollfd notifiers. */
+
+static struct timeval zero_tv = { 0 };
+
+/* Timer for libusb timeouts, only needed when libusb can't handle them
+ * itself using a timerfd among its own fd's. */
+static struct engine_timer *usb_timer;
+
+/* Convert poll() events to epoll events */
+static uint32_t poll_to_epoll(short events)
+{
+  return ((events & POLLIN) ? EPOLLIN : 0) |
+         ((events & POLLOUT) ? EPOLLOUT : 0);
+}
+
+/* Called by engine when one of the libusb fd's is ready */
+void usb_fd_ready(int fd, uint32_t events, void *data)
+{
+  libusb_context *ctx = data;
+
+  libusb_handle_events_timeout(ctx, &zero_tv);
+}
+
+/* Called by engine when a libusb timeout has expired */
+void usb_timeout_expired(void *data)
+{
+  libusb_context *ctx = data;
+
+  libusb_handle_events_timeout(ctx, &zero_tv);
+}
+
+/* Called by engine when there is MIDI input */
+void midi_fd_ready(int fd, uint32_t events, void *data)
+{
+  midi_input();
+}
+
+/* Called by libusb when it adds an fd that we should poll. */
+void usb_pollfd_added(int fd, short events, void *user_data)
 {
+  dbgprintf("USB fd %d events %d added\n", fd, events);
+  if (engine_add_fd(fd, poll_to_epoll(events) | EPOLLET,
+                    usb_fd_ready, user_data) < 0)
+    errprintf("Couldn't add USB fd %d to event engine\n", fd);
+}
+
+/* Called by libusb when an fd should no longer be polled. */
+void usb_pollfd_removed(int fd, void *user_data)
+{
+  dbgprintf("USB fd %d removed\n", fd);
+  engine_del_fd(fd);
+}
+
+/* Set up event engine with the MIDI fd's and the current libusb fd's, and
+ * register notifiers with libusb to keep it up to date. In threaded mode,
+ * the libusb fd's are left to the USB thread. */
+int events_init(libusb_context *ctx, struct polls *midipolls)
+{
+  const struct libusb_pollfd **libusb_pollfds;
+  const struct libusb_pollfd **usb_pollfd;
+  int usbfds = 0;
+  int i;
+
+  if (engine_init() < 0)
+    return -1;
+
+  for (i = 0; i < midipolls->npfd; i++) {
+    if (engine_add_fd(midipolls->pollfds[i].fd,
+                      poll_to_epoll(midipolls->pollfds[i].events) | EPOLLET,
+                      midi_fd_ready, NULL) < 0)
+      return -1;
+    printf("%d: MIDI fd %d events %d\n", i, midipolls->pollfds[i].fd,
+           midipolls->pollfds[i].events);
+  }
+
+  if (threaded)
+    return 0;
+
+  libusb_pollfds = libusb_get_pollfds(ctx);
+  if (!libusb_pollfds)
+    return -1;
+  for (usb_pollfd = libusb_pollfds; *usb_pollfd; usb_pollfd++) {
+    if (engine_add_fd((*usb_pollfd)->fd,
+                      poll_to_epoll((*usb_pollfd)->events) | EPOLLET,
+                      usb_fd_ready, ctx) < 0) {
+      free(libusb_pollfds);
+      return -1;
+    }
+    printf("%d: USB fd %d events %d\n", usbfds++,
+           (*usb_pollfd)->fd, (*usb_pollfd)->events);
+  }
+  free(libusb_pollfds);
+  printf("%d pollfd%s from libusb\n", usbfds, usbfds == 1 ? "" : "s");
+
+  libusb_set_pollfd_notifiers(ctx, usb_pollfd_added, usb_pollfd_removed, ctx);
+
+  /* Not really needed for Linux w/ timerfd support in libusb. */
+  if (!libusb_pollfds_handle_timeouts(ctx)) {
+    usb_timer = engine_timer_new(usb_timeout_expired, ctx);
+    if (!usb_timer)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Arm USB timer according to next pending libusb timeout, if any. */
+int usb_timer_update(libusb_context *ctx)
+{
+  struct timeval tv;
+  int timeouts;
+
+  timeouts = libusb_get_next_timeout(ctx, &tv);
+  if (timeouts < 0)
+    return timeouts;
+  if (timeouts) /* timeout set by get_next_timeout */
+    engine_timer_start(usb_timer, tv.tv_sec * 1000000L + tv.tv_usec, 0);
+  else
+    engine_timer_stop(usb_timer);
+
+  return 0;
+}
+
+/* LED feedback.
+ * CC's received from the host update the LEDs on the Nocturn. Updates are
+ * accumulated in the device's LED shadow state, and sent once per LED frame,
+ * so that a burst of CC's from the host results in at most one write per LED
+ * and frame, and only for LEDs that have actually changed. */
+
+/* Send one LED to Nocturn. In threaded mode, it is passed on to the USB
+ * thread, which needs to be woken up with usb_thread_wakeup() afterwards. */
+int led_send(int cc, int value, void *data)
+{
+  struct nocturn *nocturn = data;
+  struct led_update update;
+
+  if (!threaded)
+    return tx_queue_cc(&nocturn->tx, cc, value);
+
+  update.nocturn = nocturn;
+  update.cc = cc;
+  update.value = value;
+  return spsc_push(&led_ring, &update);
+}
+
+/* Called when LED frame timer expires: send all updated LEDs. */
+void led_frame(void *data)
+{
+  struct nocturn *nocturn = data;
+
+  nocturn->dev.led_timer_armed = 0;
+  if (!nocturn->connected)
+    return; /* keep LEDs for when it's reconnected */
+  if (leds_flush(&nocturn->dev.leds, led_send, nocturn) < 0)
+    printf("Couldn't send LEDs to Nocturn %d\n", nocturn->dev.index);
+  /* All of the frame goes out packed in as few transfers as possible */
+  if (!threaded)
+    tx_kick(&nocturn->tx); /* errors are picked up by nocturn_check() */
+  usb_thread_wakeup();
+
+  /* Anything we couldn't send is tried again next frame */
+  device_led_timer_arm(&nocturn->dev);
+}
+
+/* Called when CC received from host */
+void feedback_cc(int port, int ch, int cc, int value)
+{
+  struct nocturn *nocturn;
+
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+    if (nocturn->port == port)
+      break;
+  if (!nocturn)
+    return;
+
+  route_feedback(&nocturn->dev.router, ch, cc, value, &nocturn->dev.leds);
+  device_led_timer_arm(&nocturn->dev);
+}
+
+/* Called when program change received from host: recall bank, on any
+ * channel */
+void program_change(int port, int ch, int program)
+{
+  struct nocturn *nocturn;
+
+  if (program >= BANKS)
+    return;
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+    if (nocturn->port == port)
+      device_bank_select(&nocturn->dev, program);
+}
+
+/* USB thread.
+ * Handles libusb events until told to quit, and passes LED updates from
+ * the main loop on to the transmit queues in between. */
+void *usb_thread_run(void *data)
+{
+  libusb_context *ctx = data;
+  struct led_update update;
+  struct nocturn *nocturn;
+
+  while (!__atomic_load_n(&usb_thread_quit, __ATOMIC_ACQUIRE)) {
+    /* Returns early when woken up by usb_thread_wakeup() */
+    libusb_handle_events(ctx);
+
+    pthread_mutex_lock(&tx_lock);
+    while (!spsc_pop(&led_ring, &update))
+      if (tx_queue_cc(&update.nocturn->tx, update.cc, update.value) < 0 &&
+          update.nocturn->connected)
+        main_wakeup(); /* so that nocturn_check() can see it failed */
+    /* Send the LED updates, and any start-up script queued by
+     * nocturn_attach(), packed together */
+    for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+      if (nocturn->connected && tx_pending(&nocturn->tx) &&
+          tx_kick(&nocturn->tx) < 0)
+        main_wakeup();
+    pthread_mutex_unlock(&tx_lock);
+  }
+
+  return NULL;
+}
+
+/* Called by engine when woken up by USB thread: route received events. */
+void usb_wakeup_ready(int fd, uint32_t events, void *data)
+{
+  struct usb_event ev;
+  uint64_t count;
+  uint64_t now = engine_now();
+  int dropped;
+
+  if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    errprintf("Couldn't read wakeup count: %d\n", errno);
+
+  while (!spsc_pop(&event_ring, &ev))
+    device_route(ev.device, &ev.event, 1, ev.time, now);
+
+  dropped = __atomic_exchange_n(&events_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped)
+    printf("Dropped %d events from USB thread\n", dropped);
+}
+
+/* Start USB thread, with real-time priority if we're allowed to. */
+int usb_thread_start(libusb_context *ctx)
+{
+  struct sched_param param = { .sched_priority = USB_THREAD_PRIORITY };
+  pthread_attr_t attr;
   int stat;
-  int written;
 
-#if 0
-  /* First send the magical initiation strings */
-  stat = send_hexdata(usb_info->devh, usb_info->tx_ep, init_data[0], &written);
-  if (stat >= 0) {
-    printf("Wrote %d bytes\n", written);
-    stat = send_hexdata(usb_info->devh, usb_info->tx_ep, init_data[1], &written);
+  if (spsc_init(&event_ring, EVENT_RING, sizeof(struct usb_event)) < 0 ||
+      spsc_init(&led_ring, LED_RING, sizeof(struct led_update)) < 0)
+    return -1;
+
+  usb_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (usb_wakeup < 0)
+    return -1;
+  device_handoff = queue_events; /* the main loop does the routing */
+  if (engine_add_fd(usb_wakeup, EPOLLIN | EPOLLET, usb_wakeup_ready,
+                    NULL) < 0)
+    return -1;
+
+  usb_ctx = ctx;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  pthread_attr_setschedparam(&attr, &param);
+  stat = pthread_create(&usb_thread, &attr, usb_thread_run, ctx);
+  pthread_attr_destroy(&attr);
+  if (stat == EPERM) {
+    printf("Not allowed to use real-time priority for USB thread\n");
+    stat = pthread_create(&usb_thread, NULL, usb_thread_run, ctx);
   }
-  if (stat >= 0) {
-    printf("Wrote %d bytes\n", written);
-    stat = send_hexdata(usb_info->devh, usb_info->tx_ep, init_data[2], &written);
+  if (stat) {
+    printf("starting USB thread: %d\n", stat);
+    return -1;
   }
-  if (stat >= 0) {
-    printf("Wrote %d bytes\n", written);
-    stat = send_hexdata(usb_info->devh, usb_info->tx_ep, init_data[3], &written);
+
+  return 0;
+}
+
+/* Stop USB thread, and wait for it to finish. */
+void usb_thread_stop(void)
+{
+  __atomic_store_n(&usb_thread_quit, 1, __ATOMIC_RELEASE);
+  usb_thread_wakeup();
+  pthread_join(usb_thread, NULL);
+}
+
+
+/* Device handling.
+ * All Nocturns are serviced from the same event loop, each one with its
+ * own receive ring, parser, control and LED state, and ALSA port. */
+
+/* Timer for rescanning USB bus when devices have gone missing */
+static struct engine_timer *scan_timer;
+static int scan_timer_armed;
+
+/* Get USB bus and port path of device, e.g. "1-2.3" */
+void usb_path(struct libusb_device *dev, char *path, int size)
+{
+  uint8_t ports[7];
+  int nports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+  int len;
+  int i;
+
+  len = snprintf(path, size, "%d", libusb_get_bus_number(dev));
+  for (i = 0; i < nports && len < size; i++)
+    len += snprintf(path + len, size - len, "%c%d", i ? '.' : '-', ports[i]);
+}
+
+/* Create new device, with its own ALSA port. */
+struct nocturn *nocturn_new(const char *path)
+{
+  struct nocturn *nocturn, **last;
+  char name[32];
+  int index = 1;
+  int i;
+
+  for (last = &nocturns; *last; last = &(*last)->next)
+    index++;
+
+  nocturn = calloc(1, sizeof(struct nocturn));
+  if (!nocturn)
+    return NULL;
+  snprintf(nocturn->path, sizeof(nocturn->path), "%s", path);
+
+  /* First device uses the port created by midi_init() */
+  if (index == 1)
+    nocturn->port = midi_default_port();
+  else {
+    snprintf(name, sizeof(name), "Nocturn port %d", index);
+    nocturn->port = midi_create_port(name);
   }
-  if (stat >= 0)
-    printf("Wrote %d bytes\n", written);
+  if (nocturn->port < 0)
+    goto fail;
+
+  if (device_init(&nocturn->dev, index, nocturn->port, led_frame,
+                  nocturn) < 0)
+    goto fail;
 
+  /* Initial LED state from nocturn.init */
+  for (i = 0; i < init_leds_len; i += 2)
+    leds_set(&nocturn->dev.leds, init_leds[i], init_leds[i + 1]);
+
+  /* The USB thread may be walking the list in hotplug_cb() */
+  __atomic_store_n(last, nocturn, __ATOMIC_RELEASE);
+  return nocturn;
+
+fail:
+  free(nocturn);
+  return NULL;
+}
+
+/* Tear down connection to device. The device structure itself is kept. */
+void nocturn_detach(libusb_context *ctx, struct nocturn *nocturn)
+{
+  pthread_mutex_lock(&tx_lock);
+  rx_ring_free(ctx, &nocturn->ring);
+  tx_free(ctx, &nocturn->tx);
+  if (nocturn->usb_info.devh) {
+    libusb_release_interface(nocturn->usb_info.devh, 0);
+    libusb_close(nocturn->usb_info.devh);
+    nocturn->usb_info.devh = NULL;
+  }
+  nocturn->connected = 0;
+  pthread_mutex_unlock(&tx_lock);
+}
+
+/* Tell the service manager how many Nocturns are connected, and that we
+ * are ready the first time, i.e. when MIDI has been set up and the first
+ * Nocturn has been connected. */
+void nocturn_ready(void)
+{
+  static int ready;
+  struct nocturn *nocturn;
+  int connected = 0;
+
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+    connected += nocturn->connected;
+  control_notify("%sSTATUS=%d Nocturn%s connected", ready ? "" : "READY=1\n",
+                 connected, connected == 1 ? "" : "s");
+  ready = 1;
+}
+
+/* Connect to USB device dev, and start communicating with it.
+ * Return 0 if ok, LIBUSB_ERROR_foo if failure. */
+int nocturn_attach(libusb_context *ctx, struct nocturn *nocturn,
+                   struct libusb_device *dev)
+{
+  int stat;
+
+  pthread_mutex_lock(&tx_lock);
+
+  /* Attempt to connect to Nocturn */
+  stat = usb_connect(dev, &nocturn->usb_info);
   if (stat < 0) {
-    printf("sending initial usb data: %d\n", stat);
+    pthread_mutex_unlock(&tx_lock);
+    printf("Couldn't connect to Nocturn: %d\n", stat);
     return stat;
   }
 
-#endif
+  /* Now we're set up and ready to communicate */
+  parser_init(&nocturn->dev.parser);
 
-#if 1
-  /* LED ring around incrementor 1: value */
-  stat = send_hexdata(usb_info->devh, usb_info->tx_ep, "b04800", &written);
+  stat = tx_init(&nocturn->tx, nocturn->usb_info.devh,
+                 nocturn->usb_info.tx_ep, nocturn->usb_info.tx_packetsize);
   if (stat < 0) {
-    printf("sending test usb data: %d\n", stat);
-    return stat;
+    printf("allocating transfers: %d\n", stat);
+    goto fail;
   }
-  /* LED ring around incrementor 1: mode */
-  stat = send_hexdata(usb_info->devh, usb_info->tx_ep, "b04060", &written);
+
+  /* Queue start-up script, plus stored setup */
+  stat = nocturn_init(nocturn);
   if (stat < 0) {
-    printf("sending test usb data: %d\n", stat);
-    return stat;
+    printf("Couldn't send to Nocturn: %d\n", stat);
+    goto fail;
   }
-  printf("Wrote %d bytes\n", written);
-#endif
 
-#if 1
-  /* LED ring around speed dial: mode */
-  stat = send_hexdata(usb_info->devh, usb_info->tx_ep, "b05130", &written);
-  /* LED ring around speed dial: value */
-  stat = send_hexdata(usb_info->devh, usb_info->tx_ep, "b05030", &written);
-  printf("Wrote %d bytes\n", written);
-#endif
-  
-#if 0
-  /* Send a bunch of CC's */
-  int i;
-  for (i = 64; i < 128; i++) {
-    uint8_t cc[3] = { 176, i, 0x50 };
-    stat = send_data(usb_info->devh, usb_info->tx_ep, cc, 3, &written);
-    cc[1] = 0x50;
-    stat = send_data(usb_info->devh, usb_info->tx_ep, cc, 3, &written);
+  /* We don't know what the Nocturn displays after (re)connecting, so send
+   * the full LED state in one go. */
+  leds_replay(&nocturn->dev.leds);
+  if (leds_flush(&nocturn->dev.leds, led_send, nocturn) < 0)
+    printf("Couldn't send LEDs to Nocturn\n");
+  /* Script and LED state go out packed together, in one round trip */
+  if (!threaded) {
+    stat = tx_kick(&nocturn->tx);
     if (stat < 0) {
-      printf("sending usb data: %d\n", stat);
-      return stat;
+      printf("Couldn't send to Nocturn: %d\n", stat);
+      goto fail;
     }
   }
+
+#if USB_DEBUG
+  printf("Alloc %d transfers\n", rx_transfers);
+#endif
+  stat = rx_ring_alloc(&nocturn->ring, nocturn, rx_transfers);
+  if (stat < 0) {
+    printf("allocating transfers: %d\n", stat);
+    goto fail;
+  }
+
+#if USB_DEBUG
+  printf("Submit transfers\n");
 #endif
+  stat = rx_ring_submit(&nocturn->ring);
+  if (stat < 0)
+    goto fail;
+
+  nocturn->connected = 1;
+  nocturn->gone = 0;
+  if (nocturn->reconnecting)
+    metrics_add(METRIC_RECONNECTS, 1);
+  nocturn->reconnecting = 1;
+  pthread_mutex_unlock(&tx_lock);
+  usb_thread_wakeup(); /* for the script and LED state */
+  printf("Nocturn %d at %s connected, ALSA port %d\n",
+         nocturn->dev.index, nocturn->path, nocturn->port);
+  nocturn_ready();
 
   return 0;
+
+fail:
+  pthread_mutex_unlock(&tx_lock);
+  nocturn_detach(ctx, nocturn);
+  return stat;
 }
 
-int receive_loop(libusb_context *ctx, struct usb_info *usb_info,
-                 struct polls *midipolls)
+/* Find all Nocturns on the USB bus, and attach any that we aren't already
+ * connected to. Return number of devices connected. */
+int nocturn_scan(libusb_context *ctx)
+{
+  struct libusb_device **list;
+  struct nocturn *nocturn;
+  ssize_t ndevs;
+  int connected = 0;
+  int i;
+
+  ndevs = libusb_get_device_list(ctx, &list);
+  if (ndevs < 0) {
+    printf("getting usb device list: %d\n", (int) ndevs);
+    return 0;
+  }
+
+  /* Devices not found on the bus have gone, and needn't be retried */
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+    if (!nocturn->connected)
+      nocturn->gone = 1;
+
+  for (i = 0; i < ndevs; i++) {
+    struct libusb_device_descriptor descr;
+    char path[32];
+
+    if (libusb_get_device_descriptor(list[i], &descr) < 0 ||
+        descr.idVendor != vid_novation || descr.idProduct != pid_nocturn)
+      continue;
+
+    usb_path(list[i], path, sizeof(path));
+    for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+      if (!strcmp(nocturn->path, path))
+        break;
+    if (nocturn && nocturn->connected)
+      continue;
+    if (!nocturn)
+      nocturn = nocturn_new(path);
+    if (nocturn) {
+      nocturn->gone = 0;
+      nocturn_attach(ctx, nocturn, list[i]);
+    }
+  }
+  libusb_free_device_list(list, 1);
+
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+    connected += nocturn->connected;
+  if (!connected) {
+    printf("Couldn't find Nocturn at %04x:%04x\n", vid_novation, pid_nocturn);
+    control_notify("STATUS=Waiting for Nocturn");
+  }
+
+  return connected;
+}
+
+/* Called when rescan timer expires */
+void scan_expired(void *data)
+{
+  libusb_context *ctx = data;
+
+  scan_timer_armed = 0;
+  nocturn_scan(ctx);
+  /* If some device is still missing, nocturn_check() will rearm us, as it
+   * runs at the end of every main loop pass. */
+}
+
+/* Arm rescan timer, unless it is already armed */
+void scan_later(long us)
+{
+  if (scan_timer_armed)
+    return;
+  engine_timer_start(scan_timer, us, 0);
+  scan_timer_armed = 1;
+}
+
+/* Hotplug.
+ * When libusb supports it, we get told by libusb as soon as a Nocturn is
+ * plugged in or unplugged, so we don't need to poll the USB bus. As it's
+ * not safe to open devices or wait for transfers from within the hotplug
+ * callback, arriving devices are queued, and attached from nocturn_check()
+ * at the end of the same main loop pass. In threaded mode the callback is
+ * run by the USB thread, hence the queue is a ring. */
+
+/* When an arriving device can't be opened, retry after this long, doubling
+ * the delay on every failure up to HOTPLUG_RETRY_MAX_US. This typically
+ * happens when udev hasn't applied 40-nocturn.rules yet. */
+#define HOTPLUG_RETRY_US 100000
+#define HOTPLUG_RETRY_MAX_US 2000000
+
+#define HOTPLUG_ARRIVED 16
+
+static int hotplug;
+static libusb_hotplug_callback_handle hotplug_handle;
+static struct spsc arrivals;    /* struct libusb_device * */
+static int arrivals_lost;       /* set when arrivals was full */
+static long retry_us = HOTPLUG_RETRY_US;
+
+/* Called by libusb when Nocturn is plugged in or unplugged */
+int hotplug_cb(libusb_context *ctx, struct libusb_device *dev,
+               libusb_hotplug_event event, void *user_data)
+{
+  struct nocturn *nocturn;
+  char path[32];
+
+  if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+    libusb_ref_device(dev);
+    if (spsc_push(&arrivals, &dev) < 0) {
+      /* lots of arrivals, let a bus scan sort it out */
+      libusb_unref_device(dev);
+      __atomic_store_n(&arrivals_lost, 1, __ATOMIC_RELAXED);
+    }
+    main_wakeup();
+    return 0;
+  }
+
+  /* Also for devices that never got attached, so they aren't retried */
+  usb_path(dev, path, sizeof(path));
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+    if (!strcmp(nocturn->path, path))
+      nocturn->gone = 1;
+  main_wakeup();
+
+  return 0; /* keep callback registered */
+}
+
+/* Attach devices that have arrived since last time. */
+void nocturn_arrived(libusb_context *ctx)
+{
+  struct libusb_device *dev;
+  struct nocturn *nocturn;
+  char path[32];
+
+  while (!spsc_pop(&arrivals, &dev)) {
+    usb_path(dev, path, sizeof(path));
+    for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+      if (!strcmp(nocturn->path, path))
+        break;
+    if (!nocturn)
+      nocturn = nocturn_new(path);
+    if (nocturn && !nocturn->connected) {
+      nocturn->gone = 0; /* retried by nocturn_check() if attaching fails */
+      nocturn_attach(ctx, nocturn, dev);
+    }
+    libusb_unref_device(dev);
+  }
+
+  if (__atomic_exchange_n(&arrivals_lost, 0, __ATOMIC_RELAXED))
+    scan_later(0);
+}
+
+/* Set up hotplug callback, if libusb supports it. */
+void hotplug_init(libusb_context *ctx)
 {
-#define RX_BUFSIZE 10
-  uint8_t buf[RX_BUFSIZE] = { 0 };
   int stat;
-  int resubmit;
 
-  /* Only on stack if we won't return before transfer completes. */
-#if USB_DEBUG
-  printf("Alloc transfer\n");
-#endif
-  struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    printf("No USB hotplug support, polling for Nocturns\n");
+    return;
+  }
 
-#if USB_DEBUG
-  printf("Fill transfer\n");
-#endif
-  libusb_fill_interrupt_transfer(transfer,
-                                 usb_info->devh,
-                                 usb_info->rx_ep,
-                                 buf, RX_BUFSIZE,
-                                 rx_cb, &resubmit,
-                                 100);
-            
-#if USB_DEBUG               
-  printf("Submit transfer\n");      
-#endif
-  stat = libusb_submit_transfer(transfer);
+  if (spsc_init(&arrivals, HOTPLUG_ARRIVED,
+                sizeof(struct libusb_device *)) < 0)
+    return;
+
+  stat = libusb_hotplug_register_callback(ctx,
+                                          LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                                          LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                          0, vid_novation, pid_nocturn,
+                                          LIBUSB_HOTPLUG_MATCH_ANY,
+                                          hotplug_cb, NULL, &hotplug_handle);
   if (stat < 0) {
-    printf("submitting transfer: %d\n", stat);
-    goto exit_ml;
+    printf("registering usb hotplug callback: %d\n", stat);
+    return;
   }
 
-  resubmit = 0;
+  hotplug = 1;
+}
 
-  struct timeval zero_tv = { 0 };
-  printf("Now for main loop\n");
-  while (1) {
-    struct timeval tv;
-    int timeout_ms;
-    static int first_time = 1;
-
-    /* Set up polling */
-#define POLLFDS 10
-    struct pollfd pollfds[POLLFDS];
-
-    /* Set up USB polling */
-    const struct libusb_pollfd **libusb_pollfds = libusb_get_pollfds(ctx);
-    const struct libusb_pollfd **usb_pollfd = libusb_pollfds;
-    int fds;
-    for (fds = 0; fds < POLLFDS; fds++) {
-      if (!*usb_pollfd) break;
-      pollfds[fds].fd = (*usb_pollfd)->fd;
-      pollfds[fds].events = (*usb_pollfd)->events;
-      if (first_time)
-        printf("%d: USB fd %d events %d\n", fds, pollfds[fds].fd, pollfds[fds].events);
-      usb_pollfd++;
-    }
-    if (first_time)
-      printf("%d pollfd%s from libusb\n", fds, fds == 1 ? "" : "s");
-
-    /* Set up MIDI polling. Only really needed for MIDI input. */
-    int i = 0, mpolls = midipolls->npfd;
-    int usbfds = fds;
-    for (; fds < POLLFDS; fds++) {
-      if (i >= mpolls) break;
-      pollfds[fds] = midipolls->pollfds[i++];
-      if (first_time)
-        printf("%d: MIDI fd %d events %d\n", fds, pollfds[fds].fd, pollfds[fds].events);
+/* Check all devices for errors, detaching those that have failed or been
+ * unplugged, and attach new arrivals. Devices that are still plugged in
+ * but not attached are retried until they can be. */
+void nocturn_check(libusb_context *ctx)
+{
+  struct nocturn *nocturn;
+  int missing = 0, retry = 0;
+
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next) {
+    int stat = nocturn->ring.stat ? nocturn->ring.stat : nocturn->tx.stat;
+
+    if (nocturn->connected && (stat || nocturn->gone)) {
+      if (nocturn->gone)
+        printf("Nocturn %d unplugged\n", nocturn->dev.index);
+      else
+        printf("Lost connection to Nocturn %d: %d\n", nocturn->dev.index,
+               stat);
+      nocturn_detach(ctx, nocturn);
     }
-    if (first_time)
-      printf("%d pollfd%s from MIDI\n", mpolls, mpolls == 1 ? "" : "s");
-
-    /* figure out next timeout. Not really needed for Linux w/ timerfd supp. */
-    int timeouts = libusb_get_next_timeout(ctx, &tv);
-    if (timeouts < 0) {
-      stat = timeouts;
-      printf("getting next usb timeout: %d\n", stat);
-      break;
+    if (!nocturn->connected)
+      missing = 1;
+  }
+
+  if (hotplug) {
+    nocturn_arrived(ctx);
+    for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+      if (!nocturn->connected && !nocturn->gone)
+        retry = 1;
+    if (!retry)
+      retry_us = HOTPLUG_RETRY_US;
+    else if (!scan_timer_armed) {
+      scan_later(retry_us);
+      retry_us = retry_us * 2 < HOTPLUG_RETRY_MAX_US ?
+                 retry_us * 2 : HOTPLUG_RETRY_MAX_US;
     }
-#if 0 /* we probably don't need this, as we'll call handle_events_timeout
-       * unconditionally after poll() anyway */
-    if (timeouts && !memcmp(&tv, &zero_tv, sizeof(struct timeval))) {
-      printf("mainloop: libusb timed out before poll\n");
-      libusb_handle_events_timeout(ctx, &zero_tv);
+  }
+
+  /* Without hotplug, we need to go looking for missing devices */
+  if (!hotplug && (missing || !nocturns) && !scan_timer_armed) {
+    printf("Reconnecting in one second\n");
+    scan_later(1000000);
+  }
+}
+
+/* Called before exporting metrics: update gauges */
+void metrics_gauges(void)
+{
+  struct nocturn *nocturn;
+  int devices = 0, pending = 0;
+
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+    if (nocturn->connected) {
+      devices++;
+      pending += tx_pending(&nocturn->tx);
     }
-#endif
-    if (timeouts) /* timeout set by get_next_timeout */
-      timeout_ms = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  metrics_set(METRIC_DEVICES, devices);
+  metrics_set(METRIC_TX_PENDING, pending);
+}
+
+/* Set to leave main loop */
+static int quit;
+
+/* Called by engine on SIGUSR1: print latency statistics, or on SIGTERM or
+ * SIGINT: leave main loop, so that we clean up before exiting */
+void signal_ready(int fd, uint32_t events, void *data)
+{
+  struct signalfd_siginfo info;
+
+  while (read(fd, &info, sizeof(info)) == sizeof(info))
+    if (info.ssi_signo == SIGUSR1)
+      stats_dump(stdout);
     else
-      timeout_ms = -1; /* infinite timeout, since libusb didn't say */
-
-    /* In practice, poll will return fairly quickly with one POLLOUT fd
-     * so we don't want to spam debug with meaningless messages */
-    /* printf("mainloop: timeout %d ms\n", timeout_ms); */
-    int pollstat = poll(pollfds, fds, timeout_ms);
-    if (pollstat < 0) {
-      perror("polling usb and ALSA MIDI fds");
-      stat = LIBUSB_ERROR_OTHER;
-      break;
+      quit = 1;
+}
+
+/* Set up signal handling. The signals need to be blocked before any
+ * threads are started, so that they are all delivered to our signalfd. */
+static sigset_t signals;
+
+void signals_block(void)
+{
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  sigprocmask(SIG_BLOCK, &signals, NULL);
+}
+
+int signals_init(void)
+{
+  int fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  if (fd < 0)
+    return -1;
+  return engine_add_fd(fd, EPOLLIN | EPOLLET, signal_ready, NULL);
+}
+
+/* Replay.
+ * With -p, data is read from a file recorded with -c, rather than from the
+ * Nocturns, and fed through device_process_buffer() at the speed it was
+ * recorded, or sped up by the -s factor, or as fast as possible with -s 0.
+ * The events are routed with the timestamps from the file, so that the MIDI
+ * output is the same regardless of speed. */
+#define REPLAY_BATCH 64 /* max transfers per main loop pass at full speed */
+
+static char *replay_file;
+static double replay_speed = 1;
+static struct capture_reader replay_reader;
+static struct capture_record replay_rec; /* next transfer to replay */
+static struct engine_timer *replay_timer;
+static uint64_t replay_start; /* engine_now() when replay started */
+static uint64_t replay_base;  /* time corresponding to start of file */
+
+/* Return device with index, creating devices as needed */
+struct nocturn *replay_device(int index)
+{
+  struct nocturn *nocturn;
+  char path[32];
+  int n = 0;
+
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+    if (++n == index)
+      return nocturn;
+  while (n < index) {
+    snprintf(path, sizeof(path), "replay-%d", ++n);
+    nocturn = nocturn_new(path);
+    if (!nocturn)
+      return NULL;
+  }
+
+  return nocturn;
+}
+
+/* Called when it's time for the next transfer(s) */
+void replay_next(void *data)
+{
+  struct nocturn *nocturn;
+  uint64_t now = engine_now();
+  uint64_t due;
+  int stat;
+  int n;
+
+  for (n = 0; n < REPLAY_BATCH; n++) {
+    due = replay_speed ? replay_start + replay_rec.time / replay_speed : 0;
+    if (due > now) {
+      engine_timer_start(replay_timer, due - now, 0);
+      return;
     }
-#if 0 /* same here, the output fd is usually available within 100 ms or so */
-    printf("mainloop: pollstat %d\n", pollstat);
-    if (pollstat) {
-      int i;
-      for (i = 0; i < fds; i++)
-        printf("fd %d: fd %d, revents %d\n", i, pollfds[i].fd, pollfds[i].revents);
+
+    nocturn = replay_device(replay_rec.device);
+    if (nocturn)
+      device_process_buffer(&nocturn->dev, replay_rec.data, replay_rec.len,
+                     replay_base + replay_rec.time);
+
+    stat = capture_read(&replay_reader, &replay_rec);
+    if (stat <= 0) {
+      if (stat < 0)
+        printf("Capture file %s is damaged\n", replay_file);
+      printf("Replay done\n");
+      quit = 1;
+      return;
     }
-#endif
-    /* No matter if we get data or timed out, we call libusb */
-    libusb_handle_events_timeout(ctx, &zero_tv);
-
-    /* And if we get a MIDI event we handle that */
-    for (i = usbfds; i < fds; i++)
-      if (pollfds[i].revents & POLLIN)
-        midi_input();
-
-    if (resubmit) {
-      resubmit = 0;
-      /* printf("Resubmit transfer\n"); */
-      stat = libusb_submit_transfer(transfer);
-      if (stat != 0) {
-        printf("submitting transfer: %d\n", stat);
+  }
+
+  /* Let the main loop flush the MIDI before we do any more */
+  engine_timer_start(replay_timer, 1, 0);
+}
+
+/* Start replaying file */
+int replay_init(const char *filename)
+{
+  uint64_t duration = 0;
+  int stat;
+
+  /* Find length of file first */
+  if (capture_reader_open(&replay_reader, filename) < 0)
+    return -1;
+  while ((stat = capture_read(&replay_reader, &replay_rec)) > 0)
+    duration = replay_rec.time;
+  capture_reader_close(&replay_reader);
+
+  if (capture_reader_open(&replay_reader, filename) < 0)
+    return -1;
+  stat = capture_read(&replay_reader, &replay_rec);
+  if (stat <= 0) {
+    printf("Nothing to replay in %s\n", filename);
+    return -1;
+  }
+
+  replay_timer = engine_timer_new(replay_next, NULL);
+  if (!replay_timer)
+    return -1;
+
+  /* Unless replaying at the original speed, the file timestamps run ahead
+   * of the clock, so start them off in the past, to keep them from being
+   * in the future. The latency statistics are meaningless then anyway. */
+  replay_start = engine_now();
+  replay_base = replay_start - (replay_speed == 1 ? 0 : duration);
+  engine_timer_start(replay_timer, 1, 0);
+  printf("Replaying %s, %.1f s\n", filename, duration / 1e6);
+
+  return 0;
+}
+
+int receive_loop(libusb_context *ctx)
+{
+  int stat = 0;
+
+  printf("Now for main loop\n");
+  while (!quit) {
+    if (usb_timer) {
+      stat = usb_timer_update(ctx);
+      if (stat < 0) {
+        printf("getting next usb timeout: %d\n", stat);
         break;
       }
     }
-    free(libusb_pollfds);
-    first_time = 0;
-  }
 
-#if 0
-  while (1) {
-    libusb_handle_events(ctx);
-    if (resubmit) {
-      resubmit = 0;
-      /* printf("Resubmit transfer\n"); */
-      stat = libusb_submit_transfer(transfer);
-      if (stat != 0) {
-        printf("submitting transfer: %d\n", stat);
-        goto exit_ml;
-      }
+    if (engine_run_once(-1) < 0) {
+      stat = LIBUSB_ERROR_OTHER;
+      break;
+    }
+
+    /* Send all MIDI generated during this pass in one go */
+    if (midi_flush() < 0) {
+      printf("Couldn't send midi\n");
+      metrics_add(METRIC_MIDI_ERRORS, 1);
     }
+    stats_flushed(engine_now());
+    capture_drain();
+
+    /* Transfers are resubmitted by rx_cb(); if that failed we detach */
+    if (!replay_file)
+      nocturn_check(ctx);
+
+    stats_record(STATS_PASS, engine_now() - engine_wakeup_time());
   }
-#endif
 
-exit_ml:
+  return stat;
+}
 
-  libusb_free_transfer(transfer);
 
+/* Control commands.
+ * With -C, or when started by a service manager that passes us a socket,
+ * these are served on a Unix socket from the main loop, so that banks can
+ * be recalled and reloaded, and statistics fetched, without restarting and
+ * thereby dropping the ALSA ports and their connections. */
 
-#if 0
-  int showall = 0;
-  while (1) {
-    uint8_t buf[10] = { 0 };
-    int read;
-    stat = libusb_interrupt_transfer(usb_info->devh, usb_info->rx_ep, buf, 10, &read, 0);
-    if (stat == 0) {
-      if (showall || buf[1] < 96 || buf[1] > 103)
-        /* 96..103 are knobs pressed, but often generate random events */
-        printf("Read %d bytes: %d %d %d %d %d %d\n", read, buf[0], buf[1], buf[2], buf[3], buf[4], buf[5]);
-    } else
-      printf("Read stat %d\n", stat);
+/* Bank file, set using -b */
+static const char *banks_path;
+
+/* Return Nocturn given by argument i (default 1), or NULL with an error
+ * message if there is no such Nocturn. */
+struct nocturn *command_device(int argc, char **argv, int i, FILE *out)
+{
+  struct nocturn *nocturn;
+  int index = i < argc ? atoi(argv[i]) : 1;
+
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+    if (nocturn->dev.index == index)
+      return nocturn;
+  fprintf(out, "No Nocturn %s\n", i < argc ? argv[i] : "1");
+  return NULL;
+}
+
+/* Return bank given by argv[1], or -1 with an error message if invalid */
+int command_bank(int argc, char **argv, FILE *out)
+{
+  char *end;
+  long n = argc > 1 ? strtol(argv[1], &end, 10) : -1;
+
+  if (argc < 2 || *end || n < 0 || n >= BANKS) {
+    fprintf(out, "Expected bank 0..%d\n", BANKS - 1);
+    return -1;
   }
-#endif
+  return n;
+}
 
-  return stat;
+int command_devices(int argc, char **argv, FILE *out)
+{
+  struct nocturn *nocturn;
+
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next) {
+    fprintf(out, "%d %s port %d %s", nocturn->dev.index, nocturn->path,
+            nocturn->port, nocturn->connected ? "connected" : "missing");
+    if (nocturn->dev.bank >= 0)
+      fprintf(out, " bank %d", nocturn->dev.bank);
+    fprintf(out, "\n");
+  }
+  return 0;
+}
+
+int command_recall(int argc, char **argv, FILE *out)
+{
+  int n = command_bank(argc, argv, out);
+  struct nocturn *nocturn = command_device(argc, argv, 2, out);
+
+  if (n < 0 || !nocturn)
+    return -1;
+  if (!bank_map(n, NULL)) {
+    fprintf(out, "No bank %d\n", n);
+    return -1;
+  }
+  device_bank_select(&nocturn->dev, n);
+  return 0;
+}
+
+int command_store(int argc, char **argv, FILE *out)
+{
+  int n = command_bank(argc, argv, out);
+  struct nocturn *nocturn = command_device(argc, argv, 2, out);
+
+  if (n < 0 || !nocturn)
+    return -1;
+  if (bank_store(n, &nocturn->dev.router, &nocturn->dev.leds) < 0) {
+    fprintf(out, "No bank file\n");
+    return -1;
+  }
+  return 0;
+}
+
+int command_reset(int argc, char **argv, FILE *out)
+{
+  struct nocturn *nocturn = command_device(argc, argv, 1, out);
+
+  if (!nocturn)
+    return -1;
+  router_reset_map(&nocturn->dev.router);
+  nocturn->dev.bank = -1;
+  return 0;
+}
+
+/* Reopen bank file, e.g. after it has been replaced, and switch Nocturns
+ * using a bank's mapping over to the mapping in the new file, keeping the
+ * state of their controls. */
+int command_reload(int argc, char **argv, FILE *out)
+{
+  const struct control_map *map;
+  const struct router_feedback *feedback;
+  struct nocturn *nocturn;
+  int stat;
+
+  if (!banks_path) {
+    fprintf(out, "No bank file, use -b\n");
+    return -1;
+  }
+
+  /* The routers mustn't use the old mapping once it is unmapped */
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+    if (nocturn->dev.bank >= 0)
+      router_reset_map(&nocturn->dev.router);
+  banks_close();
+  stat = banks_open(banks_path);
+
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next) {
+    if (nocturn->dev.bank < 0)
+      continue;
+    map = bank_map(nocturn->dev.bank, &feedback);
+    if (map)
+      router_set_map(&nocturn->dev.router, map, feedback);
+    else {
+      fprintf(out, "Bank %d gone, Nocturn %d uses built-in mapping\n",
+              nocturn->dev.bank, nocturn->dev.index);
+      nocturn->dev.bank = -1;
+    }
+  }
+
+  if (stat < 0) {
+    fprintf(out, "Couldn't open %s\n", banks_path);
+    return -1;
+  }
+  return 0;
+}
+
+int command_stats(int argc, char **argv, FILE *out)
+{
+  stats_dump(out);
+  return 0;
+}
+
+int command_metrics(int argc, char **argv, FILE *out)
+{
+  char buf[CONTROL_REPLY];
+
+  metrics_gauges();
+  metrics_format(buf, sizeof(buf));
+  fputs(buf, out);
+  return 0;
+}
+
+static const struct control_command commands[] = {
+  { "devices", NULL, "List Nocturns", command_devices },
+  { "recall", "<bank> [<nocturn>]", "Recall bank on Nocturn (default 1)",
+    command_recall },
+  { "store", "<bank> [<nocturn>]", "Store Nocturn's state in bank",
+    command_store },
+  { "reset", "[<nocturn>]", "Switch Nocturn back to built-in mapping",
+    command_reset },
+  { "reload", NULL, "Reopen bank file, applying the mappings in it",
+    command_reload },
+  { "stats", NULL, "Latency statistics", command_stats },
+  { "metrics", NULL, "Counters, as on the metrics socket", command_metrics },
+  { NULL }
+};
+
+void usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [-d <level>] [-l] [-t] [-r <transfers>] "
+                  "[-m <socket>] [-D] [-C <socket>]\n"
+                  "       [-o <rate>] [-b <file>] [-q <ms>] [-R <device> | -J]\n"
+                  "       [-c <file> | -p <file> [-s <speed>]]\n", progname);
+  fprintf(stderr, "  -d <level>      Debug printouts: 1 = setup, 2 = also every "
+                  "event\n");
+  fprintf(stderr, "  -l              Low latency: send MIDI after each USB "
+                  "transfer\n");
+  fprintf(stderr, "  -r <transfers>  Number of USB receive transfers to keep "
+                  "in flight (default %d)\n", RX_TRANSFERS);
+  fprintf(stderr, "  -t              Threaded: handle USB in a separate "
+                  "real-time thread\n");
+  fprintf(stderr, "  -o <rate>       Send at most <rate> MIDI CC's per second "
+                  "per port\n");
+  fprintf(stderr, "  -q <ms>         Schedule MIDI <ms> after USB reception, "
+                  "for even timing\n");
+  fprintf(stderr, "  -R <device>     Send MIDI straight to rawmidi device, "
+                  "e.g. hw:1,0\n");
+  fprintf(stderr, "  -J              Use JACK MIDI ports rather than ALSA "
+                  "sequencer\n");
+  fprintf(stderr, "  -m <socket>     Export metrics on Unix socket\n");
+  fprintf(stderr, "  -D              Daemon: notify service manager when "
+                  "ready\n");
+  fprintf(stderr, "  -C <socket>     Serve control commands on Unix socket\n");
+  fprintf(stderr, "  -b <file>       Store preset banks in file\n");
+  fprintf(stderr, "  -c <file>       Capture data received from Nocturns "
+                  "to file\n");
+  fprintf(stderr, "  -p <file>       Replay captured data instead of using "
+                  "Nocturns\n");
+  fprintf(stderr, "  -s <speed>      Replay speed factor, 0 = as fast as "
+                  "possible (default 1)\n");
 }
-  
 
 int main(int argc, char **argv)
 {
   int stat = 0;
   libusb_context *ctx = NULL;
-  struct usb_info usb_info = { NULL, -1, -1 };
   struct polls *midipolls;
+  struct nocturn *nocturn;
+  const char *metrics_path = NULL;
+  const char *capture_path = NULL;
+  const char *control_path = NULL;
+  int daemon_mode = 0;
+#ifdef HAVE_JACK
+  int use_jack = 0;
+#endif
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:ltr:o:q:R:Jm:DC:b:c:p:s:")) != -1) {
+    switch (opt) {
+      case 'd':
+        debug = atoi(optarg);
+        break;
+      case 'l':
+        low_latency = 1;
+        break;
+      case 't':
+        threaded = 1;
+        break;
+      case 'o':
+        output_rate = atoi(optarg);
+        if (output_rate < 0) {
+          fprintf(stderr, "Output rate can't be negative\n");
+          return 1;
+        }
+        break;
+      case 'q':
+        midi_offset_us = atoi(optarg) * 1000;
+        if (midi_offset_us <= 0) {
+          fprintf(stderr, "Scheduling offset must be at least 1 ms\n");
+          return 1;
+        }
+        break;
+      case 'R':
+        rawmidi_device = optarg;
+        break;
+      case 'J':
+#ifdef HAVE_JACK
+        use_jack = 1;
+        break;
+#else
+        fprintf(stderr, "Not built with JACK support, use make JACK=1\n");
+        return 1;
+#endif
+      case 'm':
+        metrics_path = optarg;
+        break;
+      case 'D':
+        daemon_mode = 1;
+        break;
+      case 'C':
+        control_path = optarg;
+        break;
+      case 'b':
+        banks_path = optarg;
+        break;
+      case 'c':
+        capture_path = optarg;
+        break;
+      case 'p':
+        replay_file = optarg;
+        break;
+      case 's':
+        replay_speed = atof(optarg);
+        if (replay_speed < 0) {
+          fprintf(stderr, "Replay speed can't be negative\n");
+          return 1;
+        }
+        break;
+      case 'r':
+        rx_transfers = atoi(optarg);
+        if (rx_transfers < 1) {
+          fprintf(stderr, "Need at least one receive transfer\n");
+          return 1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (replay_file && (capture_path || threaded)) {
+    fprintf(stderr, "Can't capture or use USB thread while replaying\n");
+    return 1;
+  }
+
+  /* Under a service manager, our output goes to a log rather than a
+   * terminal, and should get there a line at a time */
+  if (daemon_mode) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    if (!control_notify_init())
+      printf("No service manager to notify\n");
+  }
+
+  signals_block();
 
-  debug = 1;
+  /* Debug printouts of events are printed in the background */
+  if (debug >= LOG_EVENTS && log_init() < 0)
+    printf("Couldn't start log thread, debug printouts will be slow\n");
 
   libusb_init(&ctx);
 
-  midipolls = midi_init_alsa();
-  if (!midipolls)
+#ifdef HAVE_JACK
+  if (use_jack)
+    midi_set_backend(&midi_jack_backend);
+  else
+#endif
+  if (rawmidi_device) {
+    if (midi_offset_us)
+      printf("Scheduled MIDI output isn't possible with rawmidi\n");
+    midi_set_backend(&midi_rawmidi_backend);
+  } else
+    midi_set_backend(&midi_alsa_backend);
+  midipolls = midi_init();
+  if (!midipolls || router_outputs_open() < 0)
     return 2;
 
   /* Normally we'd only expect one fd here, but just in case we got > 1 */
   dbgprintf("Midi poll fds: %d\n", midipolls->npfd);
 
-  /* Loop indefinitely, trying to reconnect if connection severed. */
-  do {
-    if (stat) {
-      printf("Reconnecting in one second\n");
-      sleep(1);
-    }
+  if (events_init(ctx, midipolls) < 0) {
+    printf("Couldn't set up event handling\n");
+    return 2;
+  }
 
-    /* Attempt to connect to Nocturn */
-    stat = usb_connect(ctx, &usb_info);
-    if (stat < 0) {
-      printf("Couldn't connect to Nocturn: %d\n", stat);
-      continue;
-    }
+  midi_register_cc(feedback_cc);
+  midi_register_program(program_change);
 
-    /* Now we're set up and ready to communicate */
+  if (signals_init() < 0)
+    printf("Couldn't set up signal handling, no statistics on SIGUSR1\n");
 
-    /* Send any initialization strings, plus stored setup */
-    stat = nocturn_init(&usb_info);
-    if (stat < 0) {
-      printf("Couldn't send to Nocturn: %d\n", stat);
-      continue;
-    }
+  if (metrics_path && metrics_init(metrics_path, metrics_gauges) < 0)
+    return 2;
 
-    /* Run main loop until something goes belly up */
-    stat = receive_loop(ctx, &usb_info, midipolls);
-    if (stat < 0) {
-      printf("Couldn't receive from Nocturn: %d\n", stat);
-      continue;
-    }
-  } while (stat);
+  if (banks_path && banks_open(banks_path) < 0)
+    return 2;
+
+  if (capture_path && capture_open(capture_path) < 0)
+    return 2;
+
+  /* A control socket may also be passed by the service manager */
+  if ((control_path || daemon_mode) &&
+      control_init(control_path, commands) < 0)
+    return 2;
+
+  if (threaded && usb_thread_start(ctx) < 0) {
+    printf("Couldn't start USB thread\n");
+    return 2;
+  }
+
+  scan_timer = engine_timer_new(scan_expired, ctx);
+  if (!scan_timer)
+    return 2;
+
+  if (replay_file) {
+    if (replay_init(replay_file) < 0)
+      return 2;
+    control_notify("READY=1\nSTATUS=Replaying %s", replay_file);
+  } else {
+    /* Connect to all Nocturns we can find. Any that go missing are
+     * reconnected by the main loop, as soon as they are plugged in again if
+     * we have hotplug support, or else by polling. */
+    hotplug_init(ctx);
+    nocturn_scan(ctx);
+  }
+
+  /* Run main loop until something goes belly up, or replay is done */
+  stat = receive_loop(ctx);
 
   /* Clean up */
-  libusb_close(usb_info.devh);
+  control_notify("STOPPING=1");
+  if (threaded)
+    usb_thread_stop();
+  if (hotplug)
+    libusb_hotplug_deregister_callback(ctx, hotplug_handle);
+  for (nocturn = nocturns; nocturn; nocturn = nocturn->next)
+    if (nocturn->connected)
+      nocturn_detach(ctx, nocturn);
   libusb_exit(ctx);
+  capture_close();
+  if (replay_file)
+    capture_reader_close(&replay_reader);
+  metrics_exit();
+  control_exit();
+  banks_close();
+  log_exit();
+  stats_dump(stdout);
 
   /* Be happy */
-  return 0;
+  return stat < 0 ? 1 : 0;
 }
@@ -0,0 +1,74 @@
+/****************************************************************************
+ *
+ * parser.c - parser for MIDI-like data from Nocturn
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include "parser.h"
+
+/* Initialize parser state */
+void
+parser_init(struct parser *parser)
+{
+  parser->status = 0;
+  parser->chan = 0;
+  parser->data1 = -1;
+}
+
+/* Decode buffer of data. Handle running status.
+ * The Nocturn only ever sends two-byte messages (control changes), so we
+ * don't bother with message lengths. */
+int
+parser_run(struct parser *parser, const uint8_t *data, int len,
+           struct nocturn_event *events)
+{
+  const uint8_t *end = data + len;
+  struct nocturn_event *ev = events;
+  uint8_t status = parser->status;
+  uint8_t chan = parser->chan;
+  int data1 = parser->data1;
+
+  while (data < end) {
+    uint8_t byte = *data++;
+
+    if (byte & 0x80) {
+      status = byte & 0xf0;
+      chan = byte & 0x0f;
+      data1 = -1;
+    } else if (!status) {
+      /* Data without preceding status; shouldn't happen */
+    } else if (data1 < 0) {
+      data1 = byte;
+    } else {
+      ev->status = status;
+      ev->chan = chan;
+      ev->data1 = data1;
+      ev->data2 = byte;
+      ev++;
+      data1 = -1;
+    }
+  }
+
+  parser->status = status;
+  parser->chan = chan;
+  parser->data1 = data1;
+
+  return ev - events;
+}
+
+/************************** End of file parser.c ***************************/
@@ -0,0 +1,60 @@
+/****************************************************************************
+ *
+ * parser.h - parser for MIDI-like data from Nocturn
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _PARSER_H_
+#define _PARSER_H_
+
+#include <stdint.h>
+
+/* Max number of events that can be decoded from len bytes of data:
+ * every two data bytes can complete an event, plus one event which may have
+ * been started in the previous buffer. */
+#define PARSER_MAX_EVENTS(len) ((len) / 2 + 1)
+
+/* Decoded event from Nocturn */
+struct nocturn_event
+{
+  uint8_t status; /* status without channel, e.g. 0xb0 for control change */
+  uint8_t chan;   /* 0..15 */
+  uint8_t data1;
+  uint8_t data2;
+};
+
+/* Parser state. There is one of these per device, as running status and
+ * partially received events carry over from one buffer to the next. */
+struct parser
+{
+  uint8_t status; /* running status, 0 if none received yet */
+  uint8_t chan;
+  int16_t data1;  /* first data byte of current event, -1 if none */
+};
+
+/* Initialize parser state */
+void parser_init(struct parser *parser);
+
+/* Decode len bytes of data into events, which must have room for at least
+ * PARSER_MAX_EVENTS(len) events. Return number of events decoded. */
+int parser_run(struct parser *parser, const uint8_t *data, int len,
+               struct nocturn_event *events);
+
+#endif /* _PARSER_H_ */
+
+/************************** End of file parser.h ***************************/
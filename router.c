@@ -0,0 +1,684 @@
+/****************************************************************************
+ *
+ * router.c - routing of Nocturn controls to MIDI output
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "router.h"
+#include "midi.h"
+#include "metrics.h"
+#include "debug.h"
+
+/* Max number of control changes generated per incoming CC */
+#define MAX_OUT 4
+
+/* Step size per increment for 14 bit encoders, before acceleration, so that
+ * the full range can be covered without turning for ages. */
+#define STEP14 8
+
+/* Number of CC's held back by the rate limit to send at a time */
+#define TAKE_MAX 64
+
+/* Max MIDI CC's per second on each output */
+int output_rate = 0;
+
+/* Ports of the outputs shared by all Nocturns, -1 = not open */
+static int output_ports[ROUTER_OUTPUTS] = { [0 ... ROUTER_OUTPUTS - 1] = -1 };
+
+/* Rate limit of each shared output, so that the budget is per port however
+ * many Nocturns send to it */
+static struct limiter output_limit[ROUTER_OUTPUTS];
+
+/* Reverse of control_map, built when first needed */
+static struct router_feedback control_feedback;
+static int control_feedback_built;
+
+/* NRPN state of each channel of the shared outputs' ports, as sent by all
+ * routers together */
+static struct nrpn_sent output_nrpn[ROUTER_OUTPUTS][16] = {
+  [0 ... ROUTER_OUTPUTS - 1] = { [0 ... 15] = { -1, -1 } }
+};
+
+/* CC's generated for one control, at ccs[first] onwards */
+struct group
+{
+  const struct control_map *map;
+  int first;
+  int n;
+};
+
+/* Control handler. Called with the mapping and value of an incoming CC,
+ * fills in the resulting MIDI output in out[].
+ * Return number of control changes generated (0..MAX_OUT). */
+typedef int (*control_handler)(struct router *router, int cc, int value,
+                               const struct control_map *map,
+                               struct midi_cc *out);
+
+/* Fill in control change. Return 1, i.e. the number filled in. */
+static int
+set_cc(struct midi_cc *out, int channel, int controller, int value)
+{
+  out->channel = channel;
+  out->controller = controller;
+  out->value = value;
+  return 1;
+}
+
+/* Relative incrementor or absolute control: passed through as is. */
+static int
+handle_pass(struct router *router, int cc, int value,
+            const struct control_map *map, struct midi_cc *out)
+{
+  return set_cc(out, map->channel, map->cc, value);
+}
+
+/* Momentary button or touch: passed through, normalized to 0/127. */
+static int
+handle_switch(struct router *router, int cc, int value,
+              const struct control_map *map, struct midi_cc *out)
+{
+  return set_cc(out, map->channel, map->cc, value ? 127 : 0);
+}
+
+/* Toggle button: each push flips between 127 and 0, releases ignored. */
+static int
+handle_toggle(struct router *router, int cc, int value,
+              const struct control_map *map, struct midi_cc *out)
+{
+  if (!value)
+    return 0;
+  router->toggle[cc] = router->toggle[cc] ? 0 : 127;
+  return set_cc(out, map->channel, map->cc, router->toggle[cc]);
+}
+
+/* NRPN output of encoder value: select parameter with CC 99/98, then
+ * send data entry MSB (CC 6), and for 14 bit the LSB (CC 38). What the
+ * receiver already has depends on what has been sent on each output's
+ * port and channel, so is left out by send(). */
+static int
+encoder_nrpn(struct router *router, int cc, int value,
+             const struct control_map *map, struct midi_cc *out)
+{
+  int n = 0;
+
+  n += set_cc(&out[n], map->channel, 99, MIDI_MSB(map->nrpn));
+  n += set_cc(&out[n], map->channel, 98, MIDI_LSB(map->nrpn));
+  if (map->flags & MAP_14BIT) {
+    n += set_cc(&out[n], map->channel, 6, MIDI_MSB(value));
+    n += set_cc(&out[n], map->channel, 38, MIDI_LSB(value));
+  } else
+    n += set_cc(&out[n], map->channel, 6, value);
+
+  return n;
+}
+
+/* Encoder: relative value converted to absolute using the edit map. */
+static int
+handle_encoder(struct router *router, int cc, int value,
+               const struct control_map *map, struct midi_cc *out)
+{
+  int delta = value < 64 ? value : value - 128;
+  int old = editmap_get(&router->editmap, cc);
+  int new;
+  int n = 0;
+
+  if (map->flags & MAP_14BIT)
+    new = editmap_update(&router->editmap, cc, delta, map->accel,
+                         EDITMAP_MAX14, STEP14, router->now);
+  else
+    new = editmap_update(&router->editmap, cc, delta, map->accel,
+                         EDITMAP_MAX7, 1, router->now);
+  if (new == old)
+    return 0; /* at end of range */
+
+  if (map->flags & MAP_NRPN)
+    return encoder_nrpn(router, cc, new, map, out);
+  if (!(map->flags & MAP_14BIT))
+    return set_cc(out, map->channel, map->cc, new);
+
+  /* The receiver keeps the MSB when only the LSB is sent */
+  if (MIDI_MSB(new) != router->sent_msb[cc]) {
+    router->sent_msb[cc] = MIDI_MSB(new);
+    n += set_cc(&out[n], map->channel, map->cc, MIDI_MSB(new));
+  }
+  n += set_cc(&out[n], map->channel, map->cc + 32, MIDI_LSB(new));
+  return n;
+}
+
+/* Bank button: just noted, buttons pushed meanwhile are handled by
+ * route_events(). */
+static int
+handle_bank(struct router *router, int cc, int value,
+            const struct control_map *map, struct midi_cc *out)
+{
+  router->bank_held = value != 0;
+  return 0;
+}
+
+/* Handler for each control type; NULL means ignore. */
+static const control_handler handlers[CTL_TYPES] = {
+  [CTL_NONE] = NULL,
+  [CTL_RELATIVE] = handle_pass,
+  [CTL_ABSOLUTE] = handle_pass,
+  [CTL_MOMENTARY] = handle_switch,
+  [CTL_TOGGLE] = handle_toggle,
+  [CTL_TOUCH] = handle_switch,
+  [CTL_ENCODER] = handle_encoder,
+  [CTL_BANK] = handle_bank,
+};
+
+/* Create and connect ports of shared outputs */
+int
+router_outputs_open(void)
+{
+  char name[64];
+  int o;
+
+  for (o = 1; o < router_noutputs; o++) {
+    const struct router_output *output = &router_outputs[o];
+
+    limit_init(&output_limit[o], output_rate);
+    snprintf(name, sizeof(name), "Nocturn %s", output->name);
+    output_ports[o] = midi_create_port(name);
+    if (output_ports[o] < 0) {
+      errprintf("Couldn't create port for output %s\n", output->name);
+      return output_ports[o];
+    }
+    if (output->connect && midi_connect(output_ports[o], output->connect) < 0)
+      printf("Couldn't connect output %s to %s\n", output->name,
+             output->connect);
+  }
+
+  return 0;
+}
+
+/* Initialize router state */
+void
+router_init(struct router *router, int port)
+{
+  int i;
+
+  memset(router, 0, sizeof(*router));
+  router->port = port;
+  router->bank_button = -1;
+  router->bank_request = -1;
+  for (i = 0; i < 16; i++)
+    router->nrpn[i].param = router->nrpn[i].msb = -1;
+  editmap_init(&router->editmap);
+  limit_init(&router->limit, output_rate);
+  router_reset_map(router);
+}
+
+/* Build reverse dispatch table */
+void
+router_feedback_build(struct router_feedback *feedback,
+                      const struct control_map *map_table)
+{
+  int cc;
+
+  memset(feedback->control, 0xff, sizeof(feedback->control));
+  for (cc = 0; cc < CONTROLS; cc++) {
+    const struct control_map *map = &map_table[cc];
+
+    if (map->type == CTL_NONE || (map->flags & MAP_NRPN))
+      continue; /* NRPN isn't fed back */
+    feedback->control[map->channel - 1][map->cc] = cc;
+    if (map->flags & MAP_14BIT)
+      feedback->control[map->channel - 1][map->cc + 32] = cc | FEEDBACK_LSB;
+  }
+}
+
+/* Switch dispatch table. The tables are prebuilt, so this is cheap enough
+ * to do on every bank recall. */
+void
+router_set_map(struct router *router, const struct control_map *map_table,
+               const struct router_feedback *feedback)
+{
+  int cc;
+
+  router->map = map_table;
+  router->feedback = feedback;
+
+  /* We don't know what has been sent using the previous table */
+  for (cc = 0; cc < CONTROLS; cc++)
+    router->sent_msb[cc] = -1;
+
+  /* Changes still bouncing, and MIDI held back by the rate limit, belong
+   * to the previous table, so are dropped; the controls' current state
+   * is taken as already passed on. What the shared outputs hold back may
+   * come from other Nocturns too, so is left to be sent. */
+  memset(router->bouncing, 0, sizeof(router->bouncing));
+  memcpy(router->stable, router->raw, sizeof(router->stable));
+  if (router->limit.npending)
+    limit_init(&router->limit, output_rate);
+}
+
+/* Switch to built-in dispatch table */
+void
+router_reset_map(struct router *router)
+{
+  if (!control_feedback_built) {
+    router_feedback_build(&control_feedback, control_map);
+    control_feedback_built = 1;
+  }
+  router_set_map(router, control_map, &control_feedback);
+}
+
+/* Rate limit of output o */
+static struct limiter *
+output_limiter(struct router *router, int o)
+{
+  return o ? &output_limit[o] : &router->limit;
+}
+
+/* Queue CC's on port. Return number queued. */
+static int
+queue(struct router *router, int port, const struct midi_cc *ccs, int nccs)
+{
+  if (nccs && midi_queue_control_changes(port, ccs, nccs,
+                                         router->now) < nccs) {
+    printf("Couldn't send midi\n");
+    metrics_add(METRIC_MIDI_ERRORS, 1);
+    return 0;
+  }
+  metrics_add(METRIC_MIDI_OUT, nccs);
+
+  return nccs;
+}
+
+/* Pass the n CC's at out[] generated for a control through the rate limit
+ * of an output. Return the number that can be sent right away. */
+static int
+limit(struct router *router, struct limiter *limiter,
+      const struct control_map *map, struct midi_cc *out, int n)
+{
+  if (!n)
+    return n;
+  return limit_put(limiter, out, n, map->type == CTL_RELATIVE, router->now);
+}
+
+/* Leave out the parts of the NRPN message at out[], as generated by
+ * encoder_nrpn(), that the receiver already has according to the NRPN
+ * state sent[] of the port it is sent on: the half of the parameter number
+ * that is already selected on the channel, and a data entry MSB that is
+ * the same as last time. Return number of CC's left. */
+static int
+nrpn_elide(struct nrpn_sent *sent, struct midi_cc *out, int n)
+{
+  struct nrpn_sent *state = &sent[out[0].channel - 1];
+  int param = MIDI_2BYTE(out[0].value, out[1].value);
+  int m = 0;
+  int i;
+
+  if (param != state->param) {
+    if (state->param < 0 || MIDI_MSB(state->param) != out[0].value)
+      out[m++] = out[0];
+    if (state->param < 0 || MIDI_LSB(state->param) != out[1].value)
+      out[m++] = out[1];
+    state->param = param;
+    state->msb = -1; /* in case it doesn't remember the LSB */
+  }
+  if (out[2].value != state->msb) {
+    state->msb = out[2].value;
+    out[m++] = out[2];
+  }
+  for (i = 3; i < n; i++)
+    out[m++] = out[i];
+
+  return m;
+}
+
+/* Note the n CC's generated for control map at ccs[first] onwards as a
+ * group. Return n. */
+static int
+add_group(struct group *groups, int *ngroups,
+          const struct control_map *map, int first, int n)
+{
+  if (n) {
+    groups[*ngroups].map = map;
+    groups[*ngroups].first = first;
+    groups[*ngroups].n = n;
+    (*ngroups)++;
+  }
+  return n;
+}
+
+/* Fan out groups of CC's at ccs[] to the outputs of their controls,
+ * through each output's rate limit. With take set, what the rate limit has
+ * held back is sent first. NRPN messages only make sense in sequence, so
+ * bypass the rate limit, and are cut down to what the output's receiver
+ * doesn't have once the channel is known. Everything for one output is
+ * queued in one go. Return number of CC's queued. */
+static int
+send(struct router *router, const struct midi_cc *ccs, int nccs,
+     const struct group *groups, int ngroups, int take)
+{
+  struct midi_cc out[nccs + CONTROLS * MAX_OUT];
+  int queued = 0;
+  int o, g, i;
+
+  for (o = 0; o < router_noutputs; o++) {
+    const struct router_output *output = &router_outputs[o];
+    struct limiter *limiter = output_limiter(router, o);
+    struct nrpn_sent *nrpn = o ? output_nrpn[o] : router->nrpn;
+    int port = o ? output_ports[o] : router->port;
+    int n = 0;
+
+    if (port < 0)
+      continue;
+
+    /* What the rate limit held back, as long as there is room for it */
+    while (take && n + TAKE_MAX <= CONTROLS * MAX_OUT) {
+      int taken = limit_take(limiter, router->now, &out[n], TAKE_MAX);
+
+      if (!taken)
+        break;
+      n += taken;
+    }
+
+    for (g = 0; g < ngroups; g++) {
+      const struct group *group = &groups[g];
+      struct midi_cc *first = &out[n];
+
+      if (!(group->map->outputs & (1u << o)))
+        continue;
+      for (i = 0; i < group->n; i++) {
+        first[i] = ccs[group->first + i];
+        if (output->channel)
+          first[i].channel = output->channel;
+      }
+      if (group->map->flags & MAP_NRPN)
+        n += nrpn_elide(nrpn, first, group->n);
+      else
+        n += limit(router, limiter, group->map, first, group->n);
+    }
+
+    queued += queue(router, port, out, n);
+  }
+
+  return queued;
+}
+
+/* Return non-zero if the rate limit of any output has held back MIDI */
+static int
+held_back(struct router *router)
+{
+  int o;
+
+  for (o = 0; o < router_noutputs; o++)
+    if (output_limiter(router, o)->npending)
+      return 1;
+  return 0;
+}
+
+/* Debouncing.
+ * The touch sensors, and to some extent the buttons, tend to flip back and
+ * forth a number of times when touched or released. For controls mapped
+ * with a debounce time, a new state is held back until it has been stable
+ * for that long, so only the final state is sent; changes that revert
+ * within the debounce time are not sent at all. */
+
+/* Note new state of debounced control. */
+static void
+debounce(struct router *router, int cc, int value)
+{
+  uint8_t state = value ? 127 : 0;
+  uint32_t bit = 1u << (cc % 32);
+
+  if (state != router->raw[cc]) {
+    router->raw[cc] = state;
+    router->changed[cc] = router->now;
+  }
+
+  if (router->raw[cc] != router->stable[cc])
+    router->bouncing[cc / 32] |= bit;
+  else if (router->bouncing[cc / 32] & bit) {
+    /* Flipped back before becoming stable */
+    router->bouncing[cc / 32] &= ~bit;
+    metrics_add(METRIC_EVENTS_DEBOUNCED, 1);
+  }
+}
+
+/* Pass on controls that have become stable, and MIDI held back */
+int
+router_expire(struct router *router, uint64_t now)
+{
+  struct midi_cc ccs[CONTROLS * MAX_OUT];
+  struct group groups[CONTROLS];
+  int ngroups = 0;
+  int nccs = 0;
+  int i;
+
+  router->now = now;
+  for (i = 0; i < CONTROLS / 32; i++) {
+    uint32_t bits = router->bouncing[i];
+
+    while (bits) {
+      int bit = __builtin_ctz(bits);
+      int cc = i * 32 + bit;
+      const struct control_map *map = &router->map[cc];
+
+      bits &= ~(1u << bit);
+      if (now - router->changed[cc] < map->debounce * 1000ull)
+        continue;
+      router->bouncing[i] &= ~(1u << bit);
+      router->stable[cc] = router->raw[cc];
+      if (!handlers[map->type])
+        continue;
+      nccs += add_group(groups, &ngroups, map, nccs,
+                        handlers[map->type](router, cc, router->stable[cc],
+                                            map, &ccs[nccs]));
+    }
+  }
+
+  return send(router, ccs, nccs, groups, ngroups, 1);
+}
+
+/* Time when next control becomes stable, or held back MIDI can be sent */
+uint64_t
+router_deadline(const struct router *router)
+{
+  uint64_t deadline = 0;
+  uint64_t t;
+  int i;
+  int o;
+
+  for (i = 0; i < CONTROLS / 32; i++) {
+    uint32_t bits = router->bouncing[i];
+
+    while (bits) {
+      int bit = __builtin_ctz(bits);
+      int cc = i * 32 + bit;
+
+      bits &= ~(1u << bit);
+      t = router->changed[cc] + router->map[cc].debounce * 1000ull;
+      if (!deadline || t < deadline)
+        deadline = t;
+    }
+  }
+
+  for (o = 0; o < router_noutputs; o++) {
+    t = limit_deadline(o ? &output_limit[o] : &router->limit);
+    if (t && (!deadline || t < deadline))
+      deadline = t;
+  }
+
+  return deadline;
+}
+
+/* Handle button cc selecting bank while the bank button is held.
+ * Return non-zero if the event has been consumed. */
+static int
+bank_button(struct router *router, int cc, int value,
+            const struct control_map *map)
+{
+  if (cc == router->bank_button) {
+    if (!value) {
+      router->bank_request = cc - BANK_BUTTON_FIRST;
+      if (router->now - router->bank_pushed >= BANK_STORE_US)
+        router->bank_request |= BANK_STORE;
+      router->bank_button = -1;
+    }
+    return 1;
+  }
+
+  if (!router->bank_held || !value || map->type == CTL_BANK ||
+      cc < BANK_BUTTON_FIRST || cc >= BANK_BUTTON_FIRST + BANK_BUTTONS)
+    return 0;
+
+  router->bank_button = cc;
+  router->bank_pushed = router->now;
+  return 1;
+}
+
+/* Take bank request */
+int
+router_bank_request(struct router *router)
+{
+  int request = router->bank_request;
+
+  router->bank_request = -1;
+  return request;
+}
+
+/* Route non-empty batch of events, sized for the batch. */
+static int
+route_batch(struct router *router, const struct nocturn_event *events,
+            int nevents)
+{
+  struct midi_cc ccs[nevents * MAX_OUT];
+  struct group groups[nevents];
+  int ngroups = 0;
+  int nccs = 0;
+  const struct nocturn_event *ev;
+
+  for (ev = events; ev < events + nevents; ev++) {
+    const struct control_map *map;
+    control_handler handler;
+
+    /* Nocturn only sends control changes */
+    if (ev->status != 0xb0) {
+      metrics_add(METRIC_EVENTS_IGNORED, 1);
+      continue;
+    }
+
+    map = &router->map[ev->data1];
+    handler = handlers[map->type];
+    if (!handler) {
+      metrics_add(METRIC_EVENTS_IGNORED, 1);
+      continue;
+    }
+
+    /* Touch events are very jittery, so don't print them. */
+    if (map->type != CTL_TOUCH)
+      logprintf(LOG_EVENTS, "Status %d (chan %d): %d,%d\n", ev->status,
+                ev->chan, ev->data1, ev->data2);
+
+    if (bank_button(router, ev->data1, ev->data2, map))
+      continue;
+
+    if (map->debounce) {
+      debounce(router, ev->data1, ev->data2);
+      continue;
+    }
+
+    nccs += add_group(groups, &ngroups, map, nccs,
+                      handler(router, ev->data1, ev->data2, map,
+                              &ccs[nccs]));
+  }
+
+  return send(router, ccs, nccs, groups, ngroups, 0);
+}
+
+/* Route batch of decoded events from Nocturn to MIDI output. */
+int
+route_events(struct router *router, const struct nocturn_event *events,
+             int nevents, uint64_t now)
+{
+  int expired = 0;
+  int i;
+
+  router->now = now;
+
+  /* Anything that has become stable, or has been held back, goes before
+   * the new events */
+  for (i = 0; i < CONTROLS / 32; i++)
+    if (router->bouncing[i])
+      break;
+  if (i < CONTROLS / 32 || held_back(router))
+    expired = router_expire(router, now);
+
+  if (nevents <= 0)
+    return expired;
+  return expired + route_batch(router, events, nevents);
+}
+
+/* Handle CC received from host. */
+void
+route_feedback(struct router *router, int ch, int cc, int value,
+               struct leds *leds)
+{
+  const struct control_map *map;
+  int control;
+  int led;
+
+  if (ch < 1 || ch > 16 || cc < 0 || cc > 127 || value < 0 || value > 127)
+    return;
+  control = router->feedback->control[ch - 1][cc];
+  if (control < 0)
+    return;
+  map = &router->map[control & ~FEEDBACK_LSB];
+  control &= ~FEEDBACK_LSB;
+
+  switch (map->type) {
+    case CTL_ENCODER:
+      /* Keep edit map in sync with host, so that the next increment
+       * continues from the host's value. The host may have sent the value
+       * on to the same receiver as us, so send the MSB again next time. */
+      router->sent_msb[control] = -1;
+      if (map->flags & MAP_14BIT) {
+        int old = editmap_get(&router->editmap, control);
+        if (router->feedback->control[ch - 1][cc] & FEEDBACK_LSB)
+          value = MIDI_2BYTE(MIDI_MSB(old), value);
+        else
+          value = MIDI_2BYTE(value, 0); /* new MSB resets LSB */
+        editmap_set(&router->editmap, control, value);
+        value = MIDI_MSB(value);
+      } else
+        editmap_set(&router->editmap, control, value);
+      break;
+    case CTL_TOGGLE:
+      router->toggle[control] = value ? 127 : 0;
+      break;
+    case CTL_RELATIVE:
+    case CTL_MOMENTARY:
+      break;
+    default:
+      return;
+  }
+
+  led = leds_cc(control);
+  if (led >= 0)
+    leds_set(leds, led, value);
+}
+
+/************************** End of file router.c ***************************/
+
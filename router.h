@@ -0,0 +1,203 @@
+/****************************************************************************
+ *
+ * router.h - routing of Nocturn controls to MIDI output
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+#include <stdint.h>
+
+#include "parser.h"
+#include "editmap.h"
+#include "leds.h"
+#include "limit.h"
+
+/* Number of CC's from Nocturn */
+#define CONTROLS 128
+
+/* Control types, i.e. how incoming CC's are handled */
+enum control_type
+{
+  CTL_NONE,     /* ignored */
+  CTL_RELATIVE, /* incrementor, 1..63 = increase, 65..127 = decrease */
+  CTL_ABSOLUTE, /* fader, value passed through */
+  CTL_MOMENTARY,/* button, 127 when down, 0 when up */
+  CTL_TOGGLE,   /* button, alternates between 127 and 0 for each push */
+  CTL_TOUCH,    /* incrementor touch, 127 when touched, 0 when released */
+  CTL_ENCODER,  /* incrementor, converted to absolute value using edit map */
+  CTL_BANK,     /* button, selects preset bank together with other buttons */
+  CTL_TYPES
+};
+
+/* Control map flags */
+#define MAP_14BIT 0x01 /* 14 bit output: MSB on cc, LSB on cc + 32 */
+#define MAP_NRPN 0x02  /* NRPN output: parameter nrpn, with the value as
+                        * data entry MSB (CC 6), and LSB (CC 38) if 14 bit */
+
+/* Mapping of one CC from Nocturn */
+struct control_map
+{
+  uint8_t type;    /* enum control_type */
+  uint8_t channel; /* output MIDI channel 1..16 */
+  uint8_t cc;      /* output CC */
+  uint8_t flags;   /* MAP_xxx */
+  uint8_t accel;   /* enum accel_curve, for CTL_ENCODER */
+  uint8_t debounce; /* ms new state must be stable before it is sent, for
+                     * buttons and touch; 0 = send immediately */
+  uint16_t nrpn;   /* NRPN parameter, for MAP_NRPN */
+  uint8_t outputs; /* bit set = sent on output, see router_outputs[] */
+};
+
+/* While a CTL_BANK button is held, buttons CC112..127 select preset bank
+ * 0..15 instead of sending MIDI: a short push recalls the bank, and a push
+ * held for at least BANK_STORE_US stores the current state in it. */
+#define BANK_BUTTON_FIRST 112
+#define BANK_BUTTONS 16
+#define BANK_STORE_US 1000000
+
+/* Flag in bank request: store rather than recall */
+#define BANK_STORE 0x100
+
+/* Dispatch table, indexed by incoming CC. Generated at build time from
+ * nocturn.map by mapgen.awk. */
+extern const struct control_map control_map[CONTROLS];
+
+/* Max number of outputs, including the Nocturn's own port */
+#define ROUTER_OUTPUTS 8
+
+/* MIDI output. Output 0 is the Nocturn's own port, further outputs are
+ * ports "Nocturn <name>" shared by all Nocturns, created by
+ * router_outputs_open(). */
+struct router_output
+{
+  const char *name;
+  uint8_t channel;       /* send everything on this channel 1..16, or 0 to
+                          * keep the channel of each control */
+  const char *connect;   /* ALSA address to connect port to, or NULL */
+};
+
+/* Output table, generated from nocturn.map by mapgen.awk like the dispatch
+ * table. */
+extern const struct router_output router_outputs[];
+extern const int router_noutputs;
+
+/* Flag in router feedback table: CC is LSB of 14 bit control */
+#define FEEDBACK_LSB 0x100
+
+/* Reverse dispatch table: control mapped to each MIDI channel and CC, for
+ * CC's received from the host, or -1 if none. */
+struct router_feedback
+{
+  int16_t control[16][128];
+};
+
+/* NRPN state of one MIDI channel of an output port, as sent, for leaving
+ * out what the receiver already has. */
+struct nrpn_sent
+{
+  int16_t param; /* parameter selected, or -1 if not known */
+  int16_t msb;   /* data entry MSB last sent for it, or -1 if not known */
+};
+
+/* Router state. One per device, as it holds the state of its controls. */
+struct router
+{
+  int port;                 /* own MIDI port, i.e. output 0 */
+  const struct control_map *map; /* dispatch table in use */
+  const struct router_feedback *feedback; /* reverse of map */
+  uint8_t toggle[CONTROLS]; /* current value of toggle buttons */
+  struct editmap editmap;   /* absolute values of CTL_ENCODER controls */
+  uint64_t now;             /* time of events currently being routed, us */
+  /* Debouncing: latest state received (0 or 127) for each control, and
+   * when it changed, together with the state last passed on. Controls
+   * whose latest state hasn't been passed on yet are bouncing. */
+  uint8_t raw[CONTROLS];
+  uint8_t stable[CONTROLS];
+  uint64_t changed[CONTROLS];
+  uint32_t bouncing[CONTROLS / 32];
+  /* For leaving out MIDI that doesn't change anything: the MSB last sent
+   * for each 14 bit control, or -1 if not known, and the NRPN state of
+   * each channel of the own port. The shared outputs' NRPN state is kept
+   * once per port, by the router module. */
+  int16_t sent_msb[CONTROLS];
+  struct nrpn_sent nrpn[16];
+  struct limiter limit;     /* rate limit of own port; the shared outputs'
+                             * are kept once per port, by the router module */
+  int bank_held;            /* CTL_BANK button is down */
+  int bank_button;          /* button pushed while bank_held, or -1 */
+  uint64_t bank_pushed;     /* when bank_button was pushed */
+  int bank_request;         /* bank selected, | BANK_STORE, or -1 */
+};
+
+/* Max MIDI CC's per second on each output port, 0 = no limit. Set before
+ * calling router_outputs_open() and router_init(). */
+extern int output_rate;
+
+/* Create the ports of the shared outputs, and connect them as given in the
+ * output table. Call after midi_init(). Return 0 if ok, < 0 if a port
+ * couldn't be created; failing to connect is only reported. */
+int router_outputs_open(void);
+
+/* Initialize router state, with port as output 0 */
+void router_init(struct router *router, int port);
+
+/* Build reverse dispatch table feedback from dispatch table map */
+void router_feedback_build(struct router_feedback *feedback,
+                           const struct control_map *map);
+
+/* Switch to dispatch table map, e.g. from a preset bank, with feedback
+ * built from it by router_feedback_build(). Both must stay around while in
+ * use. Changes still being debounced, and MIDI held back by the rate limit
+ * of the own port, are dropped. */
+void router_set_map(struct router *router, const struct control_map *map,
+                    const struct router_feedback *feedback);
+
+/* Switch back to the built-in dispatch table, control_map */
+void router_reset_map(struct router *router);
+
+/* Return bank selected using the bank button since last call, with
+ * BANK_STORE set if it should be stored rather than recalled, or -1 if
+ * none. */
+int router_bank_request(struct router *router);
+
+/* Route batch of decoded events from Nocturn, received at time now (us),
+ * to MIDI output. The batch may be empty. Return number of MIDI CC's
+ * queued. */
+int route_events(struct router *router, const struct nocturn_event *events,
+                 int nevents, uint64_t now);
+
+/* Pass on the state of debounced controls that have been stable long
+ * enough at time now (us), and any MIDI held back by the rate limit that
+ * may now be sent. Return number of MIDI CC's queued. This is done by
+ * route_events() too, so only needs calling when no events arrive. */
+int router_expire(struct router *router, uint64_t now);
+
+/* Return time (us) when the next bouncing control will have been stable
+ * long enough, or MIDI held back may be sent, or 0 if neither. */
+uint64_t router_deadline(const struct router *router);
+
+/* Handle CC received from host on MIDI channel ch (1..16): update the
+ * corresponding control's state and LED, if any. */
+void route_feedback(struct router *router, int ch, int cc, int value,
+                    struct leds *leds);
+
+#endif /* _ROUTER_H_ */
+
+/************************** End of file router.h ***************************/
@@ -0,0 +1,99 @@
+/****************************************************************************
+ *
+ * spsc.c - lock-free single producer, single consumer ring
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc.h"
+
+/* Set up ring */
+int
+spsc_init(struct spsc *q, unsigned size, unsigned recsize)
+{
+  if (!size || (size & (size - 1)))
+    return -1;
+
+  q->buf = malloc(size * recsize);
+  if (!q->buf)
+    return -1;
+  q->size = size;
+  q->recsize = recsize;
+  q->head = q->tail = 0;
+
+  return 0;
+}
+
+/* Push record. The indices run freely, and are masked on access, so that
+ * head - tail is always the number of records in the ring. */
+int
+spsc_push(struct spsc *q, const void *rec)
+{
+  unsigned head = q->head; /* only written by us */
+  unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+  if (head - tail >= q->size)
+    return -1;
+
+  memcpy(q->buf + (head & (q->size - 1)) * q->recsize, rec, q->recsize);
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/* Pop record */
+int
+spsc_pop(struct spsc *q, void *rec)
+{
+  unsigned tail = q->tail; /* only written by us */
+  unsigned head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+  if (head == tail)
+    return -1;
+
+  if (rec)
+    memcpy(rec, q->buf + (tail & (q->size - 1)) * q->recsize, q->recsize);
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/* Peek at oldest record */
+const void *
+spsc_peek(struct spsc *q)
+{
+  unsigned tail = q->tail;
+  unsigned head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+  if (head == tail)
+    return NULL;
+
+  return q->buf + (tail & (q->size - 1)) * q->recsize;
+}
+
+/* Free ring */
+void
+spsc_free(struct spsc *q)
+{
+  free(q->buf);
+  q->buf = NULL;
+}
+
+/*************************** End of file spsc.c *****************************/
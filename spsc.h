@@ -0,0 +1,61 @@
+/****************************************************************************
+ *
+ * spsc.h - lock-free single producer, single consumer ring
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _SPSC_H_
+#define _SPSC_H_
+
+/* Ring of fixed size records, passed from exactly one producer thread to
+ * exactly one consumer thread without any locking. The producer only ever
+ * writes head, and the consumer only ever writes tail, so all that's needed
+ * is for each side to publish its index with release semantics after it is
+ * done with the record, and to read the other side's index with acquire
+ * semantics before touching a record. */
+struct spsc
+{
+  unsigned size;       /* number of records, power of two */
+  unsigned recsize;    /* bytes per record */
+  unsigned char *buf;  /* size * recsize bytes */
+  /* Kept on separate cache lines so the two threads don't share one */
+  unsigned head __attribute__((aligned(64))); /* next record to write */
+  unsigned tail __attribute__((aligned(64))); /* next record to read */
+};
+
+/* Set up ring with room for size records of recsize bytes each. size must
+ * be a power of two. Return 0 if ok, -1 if failure. */
+int spsc_init(struct spsc *q, unsigned size, unsigned recsize);
+
+/* Copy record to ring. Producer only. Return 0 if ok, -1 if ring full. */
+int spsc_push(struct spsc *q, const void *rec);
+
+/* Copy oldest record from ring, or just drop it if rec is NULL. Consumer
+ * only. Return 0 if ok, -1 if ring empty. */
+int spsc_pop(struct spsc *q, void *rec);
+
+/* Return oldest record in ring, without removing it, or NULL if ring
+ * empty. Consumer only. The record stays valid until it is popped. */
+const void *spsc_peek(struct spsc *q);
+
+/* Free ring. Neither side may use it afterwards. */
+void spsc_free(struct spsc *q);
+
+#endif /* _SPSC_H_ */
+
+/*************************** End of file spsc.h *****************************/
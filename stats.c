@@ -0,0 +1,153 @@
+/****************************************************************************
+ *
+ * stats.c - latency statistics
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include "stats.h"
+
+/* Max number of events waiting for stats_flushed(). As MIDI is flushed at
+ * least once per main loop pass, this only needs to cover one pass. */
+#define STATS_PENDING 256
+
+struct histogram {
+  uint64_t counts[STATS_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+static struct histogram histograms[STATS_STAGES];
+
+static const char *stage_names[STATS_STAGES] = {
+  [STATS_QUEUE] = "usb->route",
+  [STATS_OUTPUT] = "usb->alsa",
+  [STATS_PASS] = "loop pass",
+};
+
+/* Receive times of events waiting to be flushed */
+static uint64_t pending[STATS_PENDING];
+static int npending;
+
+/* Return bucket for value. Values below 1 << STATS_SUB_BITS get a bucket
+ * each; above that each power of two gets 1 << STATS_SUB_BITS buckets. */
+static int
+bucket(uint64_t us)
+{
+  int msb, shift;
+
+  if (us < (1 << STATS_SUB_BITS))
+    return us;
+  if (us >= (1ull << STATS_MAX_BITS))
+    return STATS_BUCKETS - 1;
+
+  msb = 63 - __builtin_clzll(us);
+  shift = msb - STATS_SUB_BITS;
+  return ((shift + 1) << STATS_SUB_BITS) +
+         (us >> shift) - (1 << STATS_SUB_BITS);
+}
+
+/* Return highest value that ends up in bucket */
+static uint64_t
+bucket_top(int b)
+{
+  int shift = (b >> STATS_SUB_BITS) - 1;
+  int sub = b & ((1 << STATS_SUB_BITS) - 1);
+
+  if (shift < 0)
+    return b;
+  return ((uint64_t)(sub + (1 << STATS_SUB_BITS) + 1) << shift) - 1;
+}
+
+/* Add value to histogram */
+void
+stats_record(enum stats_stage stage, uint64_t us)
+{
+  struct histogram *h = &histograms[stage];
+  uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+  __atomic_add_fetch(&h->counts[bucket(us)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->total, 1, __ATOMIC_RELAXED);
+  while (us > max &&
+         !__atomic_compare_exchange_n(&h->max, &max, us, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* Note event waiting for output */
+void
+stats_queued(uint64_t rx)
+{
+  if (npending < STATS_PENDING)
+    pending[npending++] = rx;
+}
+
+/* Output done */
+void
+stats_flushed(uint64_t now)
+{
+  int i;
+
+  for (i = 0; i < npending; i++)
+    stats_record(STATS_OUTPUT, now - pending[i]);
+  npending = 0;
+}
+
+/* Return value below which fraction permille of the values lie. As the
+ * counts may be updated while we're looking, this is approximate. */
+static uint64_t
+percentile(const struct histogram *h, uint64_t total, int permille)
+{
+  uint64_t limit = (total * permille + 999) / 1000;
+  uint64_t seen = 0;
+  int b;
+
+  for (b = 0; b < STATS_BUCKETS; b++) {
+    seen += __atomic_load_n(&h->counts[b], __ATOMIC_RELAXED);
+    if (seen >= limit)
+      return bucket_top(b);
+  }
+  return bucket_top(STATS_BUCKETS - 1);
+}
+
+/* Print statistics */
+void
+stats_dump(FILE *f)
+{
+  int i;
+
+  fprintf(f, "%-12s %10s %8s %8s %8s\n", "Latency/us", "count", "p50", "p99",
+          "max");
+  for (i = 0; i < STATS_STAGES; i++) {
+    const struct histogram *h = &histograms[i];
+    uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+
+    if (!total) {
+      fprintf(f, "%-12s %10d %8s %8s %8s\n", stage_names[i], 0, "-", "-",
+              "-");
+      continue;
+    }
+    fprintf(f, "%-12s %10llu %8llu %8llu %8llu\n", stage_names[i],
+            (unsigned long long)total,
+            (unsigned long long)percentile(h, total, 500),
+            (unsigned long long)percentile(h, total, 990),
+            (unsigned long long)__atomic_load_n(&h->max, __ATOMIC_RELAXED));
+  }
+  fflush(f);
+}
+
+/*************************** End of file stats.c ****************************/
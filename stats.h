@@ -0,0 +1,62 @@
+/****************************************************************************
+ *
+ * stats.h - latency statistics
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Stages we keep latency histograms for. All times are in microseconds,
+ * from engine_now(). */
+enum stats_stage {
+  STATS_QUEUE,  /* USB transfer completed -> event routed (queue wait) */
+  STATS_OUTPUT, /* USB transfer completed -> MIDI sent to ALSA */
+  STATS_PASS,   /* main loop woken up -> main loop pass done */
+  STATS_STAGES
+};
+
+/* Histogram buckets are log-linear, as in HdrHistogram: each power of two
+ * is split into 1 << STATS_SUB_BITS equal-sized buckets, giving a relative
+ * error of at most 1/16 at any magnitude. Values from 2^STATS_MAX_BITS us
+ * (~67 s) and up all end up in the last bucket. */
+#define STATS_SUB_BITS 4
+#define STATS_MAX_BITS 26
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+/* Add one value to stage's histogram. Lock-free, can be called from any
+ * thread. */
+void stats_record(enum stats_stage stage, uint64_t us);
+
+/* Note that MIDI for an event received at time rx has been queued, and
+ * will be sent on the next stats_flushed(). Main loop only. */
+void stats_queued(uint64_t rx);
+
+/* MIDI output has been sent to ALSA; record STATS_OUTPUT for all events
+ * noted by stats_queued() since last time. Main loop only. */
+void stats_flushed(uint64_t now);
+
+/* Print count, p50, p99 and max for all stages to f */
+void stats_dump(FILE *f);
+
+#endif /* _STATS_H_ */
+
+/*************************** End of file stats.h ****************************/
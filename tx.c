@@ -0,0 +1,218 @@
+/****************************************************************************
+ *
+ * tx.c - asynchronous transmit queue for data to Nocturn
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "tx.h"
+#include "debug.h"
+
+/* Timeout for each transfer. As we never wait for transfers, this only
+ * serves to detect a hung device. */
+#define TX_TIMEOUT 500
+
+static void tx_cb(struct libusb_transfer *transfer);
+
+/* Set up transmit queue */
+int
+tx_init(struct tx_queue *tx, libusb_device_handle *devh, uint8_t ep,
+        int packetsize)
+{
+  int i;
+
+  memset(tx, 0, sizeof(*tx));
+  if (packetsize <= 0 || packetsize > TX_BUFSIZE)
+    packetsize = TX_BUFSIZE;
+
+  for (i = 0; i < TX_TRANSFERS; i++) {
+    tx->transfers[i] = libusb_alloc_transfer(0);
+    if (!tx->transfers[i])
+      return LIBUSB_ERROR_NO_MEM;
+    libusb_fill_interrupt_transfer(tx->transfers[i], devh, ep,
+                                   tx->bufs[i], 0, tx_cb, tx, TX_TIMEOUT);
+  }
+  tx->devh = devh;
+  tx->ep = ep;
+  tx->packetsize = packetsize;
+
+  return 0;
+}
+
+/* Pack as much of the script and as many pending CC's as will fit into
+ * buf, starting with status byte and using running status for the rest.
+ * Return number of bytes. */
+static int
+pack(struct tx_queue *tx, uint8_t *buf)
+{
+  uint8_t *p = buf;
+  uint8_t *end = buf + tx->packetsize;
+  int i;
+
+  *p++ = 0xb0;
+  while (tx->script_len >= 2 && p + 2 <= end) {
+    *p++ = *tx->script++;
+    *p++ = *tx->script++;
+    tx->script_len -= 2;
+  }
+
+  for (i = 0; i < 128 / 32; i++)
+    while (tx->pending[i] && p + 2 <= end) {
+      int bit = __builtin_ctz(tx->pending[i]);
+      int cc = i * 32 + bit;
+
+      *p++ = cc;
+      *p++ = tx->value[cc];
+      tx->pending[i] &= ~(1u << bit);
+    }
+
+  return p - buf;
+}
+
+/* Submit transfers for pending CC's, as long as there are free transfers.
+ * A transfer is free when its length is 0. */
+int
+tx_kick(struct tx_queue *tx)
+{
+  int i;
+
+  if (!tx->devh)
+    return LIBUSB_ERROR_NO_DEVICE;
+  if (tx->stat)
+    return tx->stat;
+
+  for (i = 0; i < TX_TRANSFERS && tx_pending(tx); i++) {
+    struct libusb_transfer *transfer = tx->transfers[i];
+    int stat;
+
+    if (transfer->length)
+      continue; /* in flight */
+    transfer->length = pack(tx, transfer->buffer);
+    /* Counted first, as it may complete before libusb returns */
+    __atomic_add_fetch(&tx->inflight, 1, __ATOMIC_RELAXED);
+    stat = libusb_submit_transfer(transfer);
+    if (stat < 0) {
+      printf("submitting usb data: %d\n", stat);
+      __atomic_sub_fetch(&tx->inflight, 1, __ATOMIC_RELAXED);
+      transfer->length = 0;
+      tx->stat = stat;
+      return stat;
+    }
+  }
+
+  return 0;
+}
+
+/* Transfer callback. Called when a transfer to Nocturn has completed. */
+static void
+tx_cb(struct libusb_transfer *transfer)
+{
+  struct tx_queue *tx = transfer->user_data;
+
+  transfer->length = 0;
+  __atomic_sub_fetch(&tx->inflight, 1, __ATOMIC_RELEASE);
+
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+      break;
+    case LIBUSB_TRANSFER_CANCELLED:
+      return;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      if (!tx->stat) tx->stat = LIBUSB_ERROR_NO_DEVICE;
+      return;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      if (!tx->stat) tx->stat = LIBUSB_ERROR_TIMEOUT;
+      return;
+    default:
+      if (!tx->stat) tx->stat = LIBUSB_ERROR_IO;
+      return;
+  }
+
+  /* Send whatever has accumulated while we were waiting */
+  if (!tx->stat)
+    tx_kick(tx);
+}
+
+/* Queue CC for sending */
+int
+tx_queue_cc(struct tx_queue *tx, int cc, int value)
+{
+  if (!tx->devh)
+    return LIBUSB_ERROR_NO_DEVICE;
+  if (tx->stat)
+    return tx->stat;
+
+  tx->value[cc] = value;
+  tx->pending[cc >> 5] |= 1u << (cc & 31);
+
+  return 0;
+}
+
+/* Queue script */
+int
+tx_queue_script(struct tx_queue *tx, const uint8_t *script, int len)
+{
+  if (!tx->devh)
+    return LIBUSB_ERROR_NO_DEVICE;
+  if (tx->stat)
+    return tx->stat;
+
+  tx->script = script;
+  tx->script_len = len & ~1;
+
+  return 0;
+}
+
+/* Return number of CC's waiting to be sent */
+int
+tx_pending(const struct tx_queue *tx)
+{
+  int n = tx->script_len / 2;
+  int i;
+
+  for (i = 0; i < 128 / 32; i++)
+    n += __builtin_popcount(tx->pending[i]);
+
+  return n;
+}
+
+/* Cancel all transfers and free everything */
+void
+tx_free(libusb_context *ctx, struct tx_queue *tx)
+{
+  int i;
+
+  if (!tx->stat)
+    tx->stat = LIBUSB_ERROR_INTERRUPTED; /* stop further submissions */
+
+  for (i = 0; i < TX_TRANSFERS; i++)
+    if (tx->transfers[i] && tx->transfers[i]->length)
+      libusb_cancel_transfer(tx->transfers[i]);
+  while (__atomic_load_n(&tx->inflight, __ATOMIC_ACQUIRE) > 0)
+    if (libusb_handle_events(ctx) < 0)
+      break;
+
+  for (i = 0; i < TX_TRANSFERS; i++)
+    if (tx->transfers[i])
+      libusb_free_transfer(tx->transfers[i]);
+  memset(tx, 0, sizeof(*tx));
+}
+
+/**************************** End of file tx.c *****************************/
@@ -0,0 +1,97 @@
+/****************************************************************************
+ *
+ * tx.h - asynchronous transmit queue for data to Nocturn
+ *
+ * Copyright (C) 2014  Ricard Wanderlof <ricard2013@butoba.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ****************************************************************************/
+
+#ifndef _TX_H_
+#define _TX_H_
+
+#include <libusb.h>
+
+/* Max size of one transfer to Nocturn */
+#define TX_BUFSIZE 64
+
+/* Max number of transfers in flight at the same time */
+#define TX_TRANSFERS 2
+
+/* Transmit queue. There is one slot per CC, holding the latest value
+ * queued for that CC, so that repeated writes to the same CC are coalesced
+ * while waiting to be sent. Writes just update the slots; tx_kick() then
+ * packs pending CC's into as few transfers as possible, using running
+ * status, so a batch of writes should be followed by one tx_kick(). When
+ * all transfers are in flight, what is pending is sent when a transfer
+ * completes, so that writing to the queue never blocks. */
+struct tx_queue
+{
+  libusb_device_handle *devh; /* NULL if not connected */
+  uint8_t ep;
+  int packetsize;             /* bytes per transfer */
+  int stat;                   /* first error encountered, 0 if none */
+  uint8_t value[128];         /* latest value for each CC */
+  uint32_t pending[128 / 32]; /* bit set = CC waiting to be sent */
+  const uint8_t *script;      /* CC/value pairs to send before the CC's */
+  int script_len;             /* bytes left in script */
+  int inflight;               /* number of transfers submitted, changed
+                               * atomically as tx_free() may wait for it
+                               * on another thread than tx_cb() runs on */
+  struct libusb_transfer *transfers[TX_TRANSFERS];
+  uint8_t bufs[TX_TRANSFERS][TX_BUFSIZE];
+};
+
+/* Set up transmit queue for endpoint ep on device devh, using transfers of
+ * at most packetsize bytes. Return 0 if ok, LIBUSB_ERROR_foo if failure. */
+int tx_init(struct tx_queue *tx, libusb_device_handle *devh, uint8_t ep,
+            int packetsize);
+
+/* The queue is modified by tx_queue_cc(), tx_queue_script(), tx_kick() and
+ * the transfer callback, the latter two also submitting transfers, so they
+ * must all be called from the same thread, i.e. the one handling libusb
+ * events. */
+
+/* Queue CC for sending. Nothing is submitted until tx_kick() is called.
+ * Return 0 if ok, or the error which stopped the queue if it has
+ * failed. */
+int tx_queue_cc(struct tx_queue *tx, int cc, int value);
+
+/* Queue script of len bytes of CC/value pairs, e.g. init_script, to be
+ * sent in order before any CC's queued with tx_queue_cc(). Nothing is
+ * submitted until tx_kick() is called. The script must
+ * stay around until it has been sent. Return 0 if ok, or the error which
+ * stopped the queue if it has failed. */
+int tx_queue_script(struct tx_queue *tx, const uint8_t *script, int len);
+
+/* Submit transfers for what is queued, as long as there are free
+ * transfers. Return 0 if ok, or the error which stopped the queue. */
+int tx_kick(struct tx_queue *tx);
+
+/* Return number of CC's waiting to be sent */
+int tx_pending(const struct tx_queue *tx);
+
+/* Cancel all transfers in flight, wait for them to finish, and free
+ * everything. Pending CC's are discarded. */
+void tx_free(libusb_context *ctx, struct tx_queue *tx);
+
+/* Start-up script, sent to Nocturn when connected. Generated at build time
+ * from nocturn.init by initgen.awk. */
+extern const uint8_t init_script[];
+extern const int init_script_len;
+
+#endif /* _TX_H_ */
+
+/**************************** End of file tx.h *****************************/